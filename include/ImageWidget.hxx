@@ -12,6 +12,7 @@
 #endif // IMAGEWIDGET_QML
 #include "opencv2/opencv.hpp"
 #include <optional>
+#include <memory>
 #include <QVariant>
 #include <QtCore/qglobal.h>
 
@@ -29,6 +30,43 @@
 class ImageWidgetPrivate;
 class ImageWidgetBasePrivate;
 
+//轻量的值类型选框，批量加载时连续存储，鼠标编辑或调用promoteBox时才提升为RectImageBox/EllipseImageBox
+struct IMAGEWIDGET_EXPORT ImageBoxData
+{
+	enum Shape
+	{
+		Rect,
+		Ellipse
+	};
+	Shape shape = Rect;
+	int id = -1;
+	QString name = "default";
+	double x = 0.;
+	double y = 0.;
+	double width = 0.;
+	double height = 0.;
+	QColor color = QColor(0, 0, 255);
+	bool display = true;
+	bool env = false;
+};
+Q_DECLARE_METATYPE(ImageBoxData)
+
+//掩码的行程编码，每段为第y行[x0,x1)内值为255的像素
+struct MaskSpan
+{
+	int y;
+	int x0;
+	int x1;
+};
+
+//裁剪到选框外接矩形（与图像求交后）的掩码，offset为其左上角在原图中的位置，矩形之外的像素值均为outside
+struct BoxMask
+{
+	cv::Mat mask;
+	cv::Point offset;
+	uchar outside = 0;
+};
+
 class IMAGEWIDGET_EXPORT ImageBox : public QObject
 {
 	Q_OBJECT
@@ -51,8 +89,8 @@ public:
 	~ImageBox();
 	virtual void operator=(const ImageBox& box);
 	Q_PROPERTY(bool display READ isDisplay WRITE setIsDisplay);
-	Q_PROPERTY(int boxID READ getBoxID WRITE setBoxID);
-	Q_PROPERTY(QString name READ getName WRITE setName);
+	Q_PROPERTY(int boxID READ getBoxID WRITE setBoxID NOTIFY boxIDChanged);
+	Q_PROPERTY(QString name READ getName WRITE setName NOTIFY nameChanged);
 	Q_PROPERTY(bool env READ isEnv WRITE setIsEnv);
 	Q_PROPERTY(bool editing READ getEditing WRITE setEditing);
 
@@ -69,6 +107,17 @@ public:
 	Q_INVOKABLE virtual void resetData() {};
 	virtual cv::Mat getMask(const QSize&) { return cv::Mat(); };
 	Q_INVOKABLE QVariant getMaskVar(const int& width,const int& height);
+	//与getMask含义相同（包括反向），但只分配外接矩形大小；默认实现由getMask裁剪得到
+	virtual BoxMask getCroppedMask(const QSize&);
+	//与getMask含义相同的行程编码，按行有序；默认实现由getMask扫描得到
+	virtual std::vector<MaskSpan> getMaskSpans(const QSize&);
+	//图像坐标下的外接矩形，用于命中测试的空间索引，空矩形表示总是参与测试
+	Q_INVOKABLE virtual QRectF getBoundingRect() { return QRectF(); };
+	virtual ImageBoxData getData();
+signals:
+	void boxIDChanged();
+	void nameChanged();
+	void geometryChanged();
 protected:
 	virtual void paintShape(QPainter*, ImageWidgetBasePrivate*) {};
 	virtual bool isInBox(const QPoint&) { return false; };
@@ -80,16 +129,20 @@ protected:
 	virtual void endPaint(const QPointF&) {};
 	virtual void editEdge(const ImageBox::GrabedEdgeType& type, const QPointF& pos) {};
 	virtual void fixShape(const QSize& size) {};
+	//形状或样式变化后调用，绘制缓存据此判断是否需要重绘
+	void touch();
 protected:
 	friend class ImageWidgetPrivate;
 	friend class ImageWidget;
 	friend class ImageWidgetBasePrivate;
 	friend class ImageWidgetBase;
+	friend class ImageBoxRegistry;
 	int boxID;
 	bool display;
 	QString name;
 	bool env;
 	bool editing;
+	quint64 revision;
 };Q_DECLARE_METATYPE(ImageBox)
 
 class IMAGEWIDGET_EXPORT RectImageBox : public ImageBox
@@ -147,8 +200,13 @@ public:
 
 	Q_INVOKABLE cv::Rect getCVRect();
 	Q_INVOKABLE void fromCVRect(const cv::Rect& rect);
+	Q_INVOKABLE virtual QRectF getBoundingRect() override;
+	virtual ImageBoxData getData() override;
 	Q_INVOKABLE virtual void resetData() override;
 	Q_INVOKABLE virtual cv::Mat getMask(const QSize&) override;
+	//按getData()的形状解析计算，不经过整幅掩码
+	virtual BoxMask getCroppedMask(const QSize&) override;
+	virtual std::vector<MaskSpan> getMaskSpans(const QSize&) override;
 protected:
 	virtual void paintShape(QPainter*, ImageWidgetBasePrivate*) override;
 	virtual bool isInBox(const QPoint&) override;
@@ -160,6 +218,7 @@ protected:
 	virtual void endPaint(const QPointF&) override;
 	virtual void editEdge(const ImageBox::GrabedEdgeType& type, const QPointF& pos) override;
 	virtual void fixShape(const QSize& size) override;
+	void paintLabel(QPainter*, ImageWidgetBasePrivate*);
 	double x;
 	double y;
 	double width;
@@ -168,6 +227,10 @@ protected:
 	QBrush brush;
 	QPen editingPen;
 	QBrush editingBrush;
+	//标签文字只在名字或整数几何变化时重建
+	QString label;
+	QString label_name;
+	QRect label_geometry;
 };
 Q_DECLARE_METATYPE(RectImageBox)
 
@@ -193,11 +256,13 @@ public:
 	void operator=(const EllipseImageBox& rb);
 	~EllipseImageBox();
 	Q_INVOKABLE virtual cv::Mat getMask(const QSize&) override;
+	virtual ImageBoxData getData() override;
 protected:
 	virtual void paintShape(QPainter*, ImageWidgetBasePrivate*) override;
 };
 Q_DECLARE_METATYPE(EllipseImageBox)
 
+class PaintDataBatch;
 class IMAGEWIDGET_EXPORT PaintData
 {
 public:
@@ -207,10 +272,30 @@ public:
 	std::vector<std::tuple<std::string,cv::Point2d,int,std::string,cv::Scalar>> texts;
 	std::vector<std::tuple<cv::Point2d, int,int, cv::Scalar>> corss_lines;
 	void drawDatas(cv::Mat& mat) const;
-	void paintDatas(QPainter*, ImageWidgetBasePrivate*);
+	void paintDatas(QPainter*, ImageWidgetBasePrivate*) const;
 	PaintData& operator<<(PaintData&);
+	//绘制缓存只按各列表的元素数与存储地址校验；绘制过的PaintData被原地修改（改写元素、清空后按相同数量重填）后须调用，丢弃缓存
+	//经PaintDataPtr共享的数据视为不可变
+	void invalidate();
+private:
+	//绘制时按样式分组的缓存，复制PaintData时不复制缓存
+	struct BatchCache
+	{
+		BatchCache() {}
+		BatchCache(const BatchCache&) {}
+		BatchCache& operator=(const BatchCache&)
+		{
+			batch.reset();
+			return *this;
+		}
+		std::shared_ptr<PaintDataBatch> batch;
+	};
+	mutable BatchCache cache;
 };
 Q_DECLARE_METATYPE(PaintData)
+//只读共享的PaintData，跨线程传递时只复制指针
+typedef std::shared_ptr<const PaintData> PaintDataPtr;
+Q_DECLARE_METATYPE(PaintDataPtr)
 Q_DECLARE_METATYPE(cv::Mat)
 class IMAGEWIDGET_EXPORT ImageWidgetBase : public
 #ifdef IMAGEWIDGET_QML
@@ -228,8 +313,156 @@ public:
 	ImageWidgetBase(QWidget* parent = Q_NULLPTR);
 #endif
 	virtual ~ImageWidgetBase();
+	struct FrameCounters
+	{
+		quint64 submitted = 0;
+		quint64 converted = 0;
+		quint64 dropped = 0;
+		quint64 presented = 0;
+	};
+	//可在任意线程调用，转换在后台线程进行，只显示最新完成的一帧
+	//8位灰度、BGR、BGRA图像不复制，显示图像直接引用Mat的数据：提交或显示后不要再原地写入该Mat，应换用新的Mat
+	//（VideoCapture::read在缓冲仍被引用时会自动分配新缓冲）；历史与录制保留的帧会复制一份，不受此限制
+	void submitCVMat(const cv::Mat&);
+	void submitCVMatWithData(const cv::Mat&, const PaintData&);
+	void submitCVMatWithData(const cv::Mat&, PaintData&&);
+	void submitCVMatWithData(const cv::Mat&, PaintDataPtr);
+	FrameCounters getFrameCounters();
+	void resetFrameCounters();
+	struct BufferPoolCounters
+	{
+		quint64 hits = 0;
+		quint64 misses = 0;
+		quint64 buffers = 0;
+		quint64 bytes = 0;
+	};
+	BufferPoolCounters getBufferPoolCounters();
+	void resetBufferPoolCounters();
+	//每种尺寸保留的缓冲数量，默认3（三缓冲）
+	void setBufferPoolDepth(const int& depth);
+	//像素数不小于该值的图像缩小显示时使用多分辨率瓦片绘制，0表示关闭
+	void setPyramidThreshold(const qint64& pixels);
+	//非8位图像（16位、浮点等）按窗宽窗位映射到8位显示，设置后关闭自动窗
+	void setWindowLevel(const double& window, const double& level);
+	//按抽样直方图的百分位自动计算窗宽窗位，默认开启
+	void setAutoWindow(const bool& enable, const double& low_percent = 0.5, const double& high_percent = 99.5);
+	double getWindow();
+	double getLevel();
+	//单通道图像的伪彩色显示，参数为cv::ColormapTypes，-1恢复灰度
+	void setColorMap(const int& colormap);
+	//自定义256项颜色表，空表恢复灰度
+	void setColorTable(const QVector<QRgb>& table);
+	//PaintData中显示尺寸小于该像素数的图元合并为一张占位图绘制，0表示关闭，默认1
+	void setOverlayLodThreshold(const double& pixels);
+	//右值重载直接移动PaintData，不做深拷贝
+	void displayCVMatWithData(const cv::Mat&, PaintData&&);
+	void displayQImageWithData(const QImage&, PaintData&&);
+	void displayDoneCVMatWithData(const cv::Mat&, PaintData&&);
+	void displayDoneQImageWithData(const QImage&, PaintData&&);
+	//命名叠加层，按z从小到大绘制，z小于0的层在帧数据之下；每层按视口缓存栅格，内容或视口不变时不重绘
+	void setOverlayLayer(const QString& name, const PaintData& data, const int& z = 0);
+	void setOverlayLayer(const QString& name, PaintData&& data, const int& z = 0);
+	void removeOverlayLayer(const QString& name);
+	void setOverlayLayerVisible(const QString& name, const bool& visible);
+	void clearOverlayLayers();
+	QStringList getOverlayLayers();
+	//持久叠加层，可在任意线程调用；元素句柄稳定，批量增删改后只重绘变化区域
+	typedef quint64 OverlayHandle;
+	//返回的句柄依次对应lines、rects、circles、texts、corss_lines中的元素
+	std::vector<OverlayHandle> appendOverlayItems(const PaintData& items);
+	//每种类型的第k个句柄由items中该类型的第k个元素替换，失效的句柄被忽略
+	void updateOverlayItems(const std::vector<OverlayHandle>& handles, const PaintData& items);
+	void removeOverlayItems(const std::vector<OverlayHandle>& handles);
+	void clearOverlayItems();
+	size_t getOverlayItemCount();
+	//导出在后台队列中按提交顺序执行，原图与绘制数据按引用计数快照，提交后可继续显示新帧
+	//返回导出编号，进度与结果由exportProgress、exportFinished给出；格式由文件后缀决定
+	//显示的帧没有原图（displayQImage显示的图像、完成图、原图已释放的历史帧）时不导出，返回0
+	quint64 exportSourceImage(const QString& file);
+	//在显示的8位图像（窗宽窗位与伪彩色之后）上叠加当前PaintData，以BGR导出
+	quint64 exportPaintedImage(const QString& file);
+	//PNG压缩级别0-9，默认3；JPEG质量0-100，默认95；对之后提交的导出生效
+	void setExportPngCompression(const int& level);
+	void setExportJpegQuality(const int& quality);
+	int getPendingExportCount();
+	struct RecordingCounters
+	{
+		quint64 queued = 0;
+		quint64 written = 0;
+		quint64 dropped = 0;
+		//队列中尚未写完的帧持有的图像字节
+		qint64 queued_bytes = 0;
+	};
+	//录制显示出的帧（窗宽窗位、伪彩色之后的图像）及其PaintData与选框，显示线程只入队引用计数快照，队列满时丢帧并计数
+	//format为图像序列后缀（jpg、png、bmp、tif）或视频容器（avi、mp4）；每segment_seconds秒一个分段目录，keep_seconds大于0时只保留最近的分段
+	//队列最多queue_capacity帧、queue_bytes字节（0表示只按帧数限制），超出任一上限即丢帧
+	bool startRecording(const QString& dir, const QString& format = "jpg", const int& queue_capacity = 64, const double& fps = 25., const int& segment_seconds = 60, const int& keep_seconds = 0, const qint64& queue_bytes = 256 * 1024 * 1024);
+	//不等待写完，队列中剩余的帧在后台写入
+	void stopRecording();
+	bool isRecording();
+	RecordingCounters getRecordingCounters();
+	//分段目录中overlay.bin的一条记录，frame为该帧在分段内的序号
+	struct RecordedOverlay
+	{
+		quint64 index = 0;
+		qint64 timestamp = 0;
+		int frame = 0;
+		PaintData data;
+		std::vector<ImageBoxData> boxes;
+	};
+	static std::vector<RecordedOverlay> readRecordingSidecar(const QString& file);
+	//最近显示帧及其PaintData的历史，总量不超过budget_bytes，0表示关闭
+	//最新的full_frames帧原样保留，更早的帧在后台按old_scale缩小，compress_old时再以JPEG压缩，显示时恢复原尺寸
+	void setFrameHistory(const qint64& budget_bytes, const int& full_frames = 8, const double& old_scale = 0.5, const bool& compress_old = false);
+	int getFrameHistorySize();
+	qint64 getFrameHistoryBytes();
+	//暂停时画面停在当前帧，新帧照常接收、录制并进入历史，恢复后显示最新帧；暂停时Ctrl+滚轮逐帧浏览历史
+	//暂停时导出、ROI统计与裁剪使用显示的历史帧的原图，该帧已缩小、原图已释放时导出失败、统计为空
+	void setLivePaused(const bool& pause);
+	//显示的帧（暂停时为历史帧）是否有可用的原图
+	bool hasCurrentSourceImage();
+	bool isLivePaused();
+	//offset为0表示最新一帧，越大越早，未暂停时先暂停
+	void showHistoryFrame(const int& offset);
+	//delta为正向更早的帧移动
+	void stepHistory(const int& delta);
+	int getHistoryOffset();
+	//控件持有的像素内存，按数据指针去重，共享同一块内存的原图与显示图像只计一次
+	struct PixelFootprint
+	{
+		qint64 display = 0;
+		qint64 done = 0;
+		qint64 source = 0;
+		//金字塔、瓦片、积分图
+		qint64 caches = 0;
+		//叠加层与选框栅格
+		qint64 overlays = 0;
+		qint64 history = 0;
+		//缓冲池中未被引用的缓冲
+		qint64 buffer_pool = 0;
+		//录制队列中等待写入的帧，与显示图像共享的最新帧也计入
+		qint64 recording = 0;
+		//后台导出与历史缩小任务持有的快照及其生成的数据
+		qint64 in_flight = 0;
+		qint64 total() const
+		{
+			return display + done + source + caches + overlays + history + buffer_pool + recording + in_flight;
+		}
+	};
+	PixelFootprint getPixelFootprint();
+	//所有控件合计，不同控件共享的内存只计一次
+	static PixelFootprint getGlobalPixelFootprint();
+	//超出预算时依次释放：过期的完成图、空闲缓冲与积分图；缓存、叠加层与选框栅格、较旧历史帧的原图（并提前缩小这些帧）；
+	//最后录制队列限流，隐藏控件释放由原图转换出的显示图像并停止显示新帧，再次绘制时由原图重建并显示最新一帧
+	//0表示不限制，新帧显示后自动检查
+	void setPixelBudget(const qint64& bytes);
+	qint64 getPixelBudget();
+	static void setGlobalPixelBudget(const qint64& bytes);
+	static qint64 getGlobalPixelBudget();
+	void enforcePixelBudget();
 public slots:
 	;
+	//与submitCVMat相同，8位图像不复制，显示后不要再原地写入该Mat
 	void displayCVMat(cv::Mat);
 	void displayQImage(const QImage&);
 	void displayCVMatWithData(const cv::Mat&, const PaintData&);
@@ -238,6 +471,11 @@ public slots:
 	void displayDoneQImage(const QImage&);
 	void displayDoneCVMatWithData(const cv::Mat&, const PaintData&);
 	void displayDoneQImageWithData(const QImage&, const PaintData&);
+	void displayCVMatWithData(const cv::Mat&, PaintDataPtr);
+	void displayQImageWithData(const QImage&, PaintDataPtr);
+	void displayDoneCVMatWithData(const cv::Mat&, PaintDataPtr);
+	void displayDoneQImageWithData(const QImage&, PaintDataPtr);
+	void setOverlayLayer(const QString& name, PaintDataPtr data, const int& z = 0);
 	void displayCVMat(QVariant);
 	void displayQImage(const QVariant& img);
 	void displayCVMatWithData(const QVariant& img, const QVariant& paint_data);
@@ -249,6 +487,9 @@ public slots:
 	void resetScale();
 	void setBackgroudColor(const QColor&);
 signals:
+	void exportProgress(quint64 id, int percent);
+	void exportFinished(quint64 id, const QString& file, bool ok);
+	void historyPositionChanged(int offset, int size);
 	void clickedPosition(QPoint);
 	void underMouseSourcePosition(QPoint);
 	void underMouseTargetPosition(QPoint);
@@ -281,6 +522,75 @@ public:
 #endif
 
 	virtual ~ImageWidget();
+	enum MaskCombineRule
+	{
+		MaskUnion,
+		MaskIntersection,
+		//第一个选框减去其余选框
+		MaskSubtraction
+	};
+	//按id或名字选取选框，按规则一次扫描合成掩码（反向选框按补集参与），size为空时使用当前图像大小
+	cv::Mat composeMask(const QList<int>& ids, const int& rule, const QSize& size = QSize());
+	cv::Mat composeMaskByName(const QString& name, const int& rule, const QSize& size = QSize());
+	struct RoiStatistics
+	{
+		int id = -1;
+		QString name;
+		//参与统计的像素数
+		quint64 count = 0;
+		cv::Scalar mean;
+		cv::Scalar stddev;
+		cv::Scalar min;
+		cv::Scalar max;
+		//每通道histogram_bins个计数，区间[histogram_low,histogram_high)，超出范围的像素不计；histogram_high<=histogram_low时为空
+		std::vector<std::vector<quint64>> histogram;
+	};
+	//在当前显示的原图上按选框形状（含反向）逐区间统计，不生成掩码，各选框并行，结果与选取顺序一致
+	//显示的帧没有原图（displayQImage显示的图像、完成图、原图已释放的历史帧）时返回空
+	std::vector<RoiStatistics> getRoiStatistics(const QList<int>& ids, const int& histogram_bins = 0, const double& histogram_low = 0., const double& histogram_high = 256.);
+	std::vector<RoiStatistics> getRoiStatisticsByName(const QString& name, const int& histogram_bins = 0, const double& histogram_low = 0., const double& histogram_high = 256.);
+	//选框外接矩形在当前原图上的视图，已裁剪到图像范围，与原图共享像素，不复制
+	struct RoiCrop
+	{
+		int id = -1;
+		QString name;
+		cv::Rect rect;
+		cv::Mat view;
+	};
+	//显示的帧没有原图时返回空
+	std::vector<RoiCrop> getRoiCrops(const QList<int>& ids);
+	std::vector<RoiCrop> getRoiCropsByName(const QString& name);
+	//把各视图并行拷贝到一块连续的N x H x W缓冲（类型与原图一致，通道交错），batch尺寸不变时复用内存
+	//size为空时取各视图的最大宽高，左上对齐并补0；否则各视图缩放到size
+	static void packRoiCrops(const std::vector<RoiCrop>& crops, cv::Mat& batch, const QSize& size = QSize());
+	//选框掩码加入后台导出队列，选框形状在提交时快照，id不存在时返回0
+	quint64 exportBoxMask(ImageBox* box, const QString& file);
+	quint64 exportBoxMask(const int& id, const QString& file);
+	//拖动选框时的实时统计，由当前帧的积分图与平方积分图得出，不含极值与直方图
+	struct LiveRoiStatistics
+	{
+		int id = -1;
+		QString name;
+		quint64 count = 0;
+		cv::Scalar sum;
+		cv::Scalar mean;
+		cv::Scalar variance;
+	};
+	//开启后拖动或缩放选框时按鼠标频率发出liveRoiStatisticsChanged，积分图按帧在后台惰性构建
+	void setLiveRoiStatisticsEnabled(const bool& enable);
+	bool isLiveRoiStatisticsEnabled();
+	//批量增删作为一次事务，只刷新一次
+	void addImageBoxes(const QList<ImageBox*>& boxes);
+	void removeImageBoxes(const QList<int>& ids);
+	//以值类型批量加载选框，不创建QObject，与已有选框id重复时替换
+	void addImageBoxData(const std::vector<ImageBoxData>& boxes);
+	//全部选框的值类型快照，先按z序列出QObject选框，再列出轻量选框（上层在前）
+	std::vector<ImageBoxData> getImageBoxData();
+	//按id或名字查询选框的值类型数据，包括轻量选框，不会提升
+	bool getImageBoxDataFromId(const int& id, ImageBoxData& data);
+	std::vector<ImageBoxData> getImageBoxDataFromName(const QString& name);
+	//把轻量选框提升为QObject选框，放在QObject选框的最下层，已是QObject选框时直接返回，不存在时返回nullptr
+	Q_INVOKABLE ImageBox* promoteBox(const int& id);
 public slots:
 	void paintNewImageBox(QVariant box);
 	void addImageBox(QVariant box);
@@ -288,11 +598,15 @@ public slots:
 	void addImageBox(ImageBox* box);
 	void removeImageBoxById(const int& id);
 	void removeImageBoxByName(const QString& name);
+	//只返回QObject选框，轻量选框用getImageBoxDataFromId查询或用promoteBox提升
 	ImageBox* getImageBoxFromId(const int& id);
+	//供QML与属性绑定使用，需要QObject，命中的轻量选框按promoteBox提升
 	QVariant getImageBoxVarFromId(const int& id);
 	QList<ImageBox*> getImageBoxsFromName(const QString& name);
 	QVariantList getImageBoxVarlistFromName(const QString& name);
 	void clearAllBoxs();
+signals:
+	void liveRoiStatisticsChanged(const ImageWidget::LiveRoiStatistics& stats);
 protected:
 	virtual void mousePressEvent(QMouseEvent*) override;
 	virtual void mouseMoveEvent(QMouseEvent*) override;
@@ -310,6 +624,7 @@ protected:
 private:
 	ImageWidgetPrivate* d_ptr;
 };
+Q_DECLARE_METATYPE(ImageWidget::LiveRoiStatistics)
 
 #ifdef IMAGEWIDGET_QML
 QML_DECLARE_TYPE(ImageWidget)
@@ -3,680 +3,5577 @@
 #include <QMouseEvent>
 #include <QLinkedList>
 #include <QPainter>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QCache>
+#include <QHash>
+#include <QSet>
+#include <QStaticText>
+#include <QFontInfo>
+#include <QFontMetricsF>
+#include <QRegion>
+#include <QFile>
+#include <QFileInfo>
+#include <QDir>
+#include <QDateTime>
+#include <QDataStream>
+#include <QBuffer>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <map>
+#include <algorithm>
+#include <cmath>
+#include <memory>
+#include <array>
+#include <limits>
+#include <iterator>
+#include <list>
+#include <unordered_map>
+#include <unordered_set>
+#include <cstring>
+#include <deque>
+#include <chrono>
+#include <condition_variable>
+#include <typeinfo>
 #ifndef IMAGEWIDGET_QML
 #include <QMenu>
 #include <QFileDialog>
 #include <QMessageBox>
 #endif
 const int grabedge_thresh = 3;
+const int pyramid_tile_size = 512;
+//选框命中测试网格的单元边长（图像像素）
+const int box_grid_cell = 128;
+//像素数超过该值的图像在缩小显示时使用金字塔
+const qint64 pyramid_default_threshold = qint64(32) * 1024 * 1024;
 
-class ImageWidgetBasePrivate : public QObject
+class ImageWidgetRunnable : public QRunnable
 {
-	Q_OBJECT
 public:
-	ImageWidgetBasePrivate(ImageWidgetBase* parent) :
-		q_ptr(parent),
-		done_flag(false),
-		log_zoom(1.),
-		moving(false),
-		backgroudcolor(125,125,125)
+	ImageWidgetRunnable(std::function<void()> f) :
+		func(std::move(f))
 	{
-		connect(&done_timer, &QTimer::timeout, this, &ImageWidgetBasePrivate::doneImageTimerTimeout);
 	}
-	~ImageWidgetBasePrivate() {}
-private:
-	friend ImageWidgetBase;
-	friend ImageWidget;
-	ImageWidgetBase* q_ptr;
-	cv::Mat rgb;
-	cv::Mat rgb_done;
-	QPixmap display_img;
-	QPixmap display_img_done;
-	QTimer done_timer;
-	bool done_flag;
-	double log_zoom;
-	QPointF start_point;
-	QPointF source_position;
-	QSizeF source_size;
-	bool moving;
-	PaintData done_paint_data;
-	PaintData paint_data;
-	QColor backgroudcolor;
-public:
-	double getLogZoom()
+	virtual void run() override
 	{
-		return log_zoom;
+		func();
 	}
+private:
+	std::function<void()> func;
+};
 
-	QSize getImageSize()
-	{
-		if (done_flag)
-		{
-			return display_img_done.size();
-		}
-		else
-		{
-			return display_img.size();
-		}
-	}
+static void releaseMatImage(void* info)
+{
+	delete static_cast<cv::Mat*>(info);
+}
+
+//QImage直接引用cv::Mat的数据，Mat的引用计数由QImage持有
+static QImage matToQImageView(const cv::Mat& m, QImage::Format format)
+{
+	auto holder = new cv::Mat(m);
+	return QImage(holder->data, holder->cols, holder->rows, int(holder->step), format, releaseMatImage, holder);
+}
+
+//显示图像（已做窗宽窗位与伪彩色）转为独立的BGR图像，供叠加绘制后导出
+static cv::Mat qImageToBgrMat(const QImage& img)
+{
+	if (img.isNull())
+		return cv::Mat();
+	auto rgb = img.convertToFormat(QImage::Format_RGB888);
+	cv::Mat view(rgb.height(), rgb.width(), CV_8UC3, const_cast<uchar*>(rgb.constBits()), size_t(rgb.bytesPerLine()));
+	cv::Mat out;
+	cv::cvtColor(view, out, cv::COLOR_RGB2BGR);
+	return out;
+}
 
-	QImage cvMatToQImage(const cv::Mat& m, bool is_done = false)
+//抽样统计直方图，按百分位得到显示范围
+template <typename T>
+static bool sampleWindowRange(const cv::Mat& m, const double& low_percent, const double& high_percent, double& low, double& high)
+{
+	auto step = std::max(1, int(std::sqrt(double(m.total()) / 65536.)));
+	auto row_len = m.cols * m.channels();
+	std::vector<float> samples;
+	samples.reserve(size_t((m.rows / step + 1) * (row_len / step + 1)));
+	for (int y = 0; y < m.rows; y += step)
 	{
-		if (is_done)
+		auto row = m.ptr<T>(y);
+		for (int x = 0; x < row_len; x += step)
 		{
-			rgb_done.release();
-			switch (m.channels())
-			{
-			case 1:
-				cv::cvtColor(m, rgb_done, cv::COLOR_GRAY2RGB);
-				break;
-			case 3:
-				cv::cvtColor(m, rgb_done, cv::COLOR_BGR2RGB);
-				break;
-			case 4:
-				cv::cvtColor(m, rgb_done, cv::COLOR_BGRA2RGB);
-				break;
-			default:
-				return QImage();
-			}
-			return QImage(rgb_done.data, rgb_done.cols, rgb_done.rows, rgb_done.step, QImage::Format::Format_RGB888);
-		}
-		else {
-			rgb.release();
-			switch (m.channels())
+			float v = float(row[x]);
+			if (std::isfinite(v))
 			{
-			case 1:
-				cv::cvtColor(m, rgb, cv::COLOR_GRAY2RGB);
-				break;
-			case 3:
-				cv::cvtColor(m, rgb, cv::COLOR_BGR2RGB);
-				break;
-			case 4:
-				cv::cvtColor(m, rgb, cv::COLOR_BGRA2RGB);
-				break;
-			default:
-				return QImage();
+				samples.push_back(v);
 			}
-			return QImage(rgb.data, rgb.cols, rgb.rows, rgb.step, QImage::Format::Format_RGB888);
 		}
 	}
-
-	void startDoneImageTimer(const int& ms = 2000)
+	if (samples.empty())
 	{
-		done_timer.start(ms);
-		done_flag = true;
+		return false;
 	}
-
-	void doneImageTimerTimeout()
+	auto range = std::minmax_element(samples.begin(), samples.end());
+	double min_val = *range.first;
+	double max_val = *range.second;
+	if (max_val <= min_val)
 	{
-		done_flag = false;
-		done_timer.stop();
-		done_paint_data = PaintData();
-		paint_data = PaintData();
-		q_ptr->update();
+		low = min_val;
+		high = min_val + 1.;
+		return true;
 	}
-	double getAveragePower()
+	const int bins = 4096;
+	std::vector<int> hist(bins, 0);
+	auto bin_scale = (bins - 1) / (max_val - min_val);
+	for (const auto& v : samples)
 	{
-		return (getXPower() + getYPower()) / 2.;
+		hist[int((v - min_val) * bin_scale)]++;
 	}
-	void zoomIn(QWheelEvent* e)
+	auto low_count = double(samples.size()) * low_percent / 100.;
+	auto high_count = double(samples.size()) * high_percent / 100.;
+	int low_bin(0), high_bin(bins - 1);
+	double acc(0);
+	for (int i = 0; i < bins; i++)
 	{
-		auto m = e->posF();
-
-		float power;
-		if (source_size.width() > source_size.height())
+		acc += hist[i];
+		if (acc <= low_count)
 		{
-			power = float(source_size.width()) / float(q_ptr->width());
+			low_bin = i;
 		}
-		else
+		if (acc >= high_count)
 		{
-			power = float(source_size.height()) / float(q_ptr->height());
+			high_bin = i;
+			break;
 		}
-
-
-		m.setX(m.x() * power); m.setY(m.y() * power);
-		m *= 0.05;
-		source_position += m;
-		source_size *= 0.95;
-		q_ptr->update();
 	}
-	void zoomOut(QWheelEvent* e)
+	low = min_val + low_bin / bin_scale;
+	high = min_val + (high_bin + 1) / bin_scale;
+	if (high <= low)
 	{
-		auto m = e->posF();
+		high = low + 1.;
+	}
+	return true;
+}
 
-		float power;
-		if (source_size.width() > source_size.height())
-		{
-			power = float(source_size.width()) / float(q_ptr->width());
-		}
-		else
+static bool sampleWindowRange(const cv::Mat& m, const double& low_percent, const double& high_percent, double& low, double& high)
+{
+	switch (m.depth())
+	{
+	case CV_8S:
+		return sampleWindowRange<schar>(m, low_percent, high_percent, low, high);
+	case CV_16U:
+		return sampleWindowRange<ushort>(m, low_percent, high_percent, low, high);
+	case CV_16S:
+		return sampleWindowRange<short>(m, low_percent, high_percent, low, high);
+	case CV_32S:
+		return sampleWindowRange<int>(m, low_percent, high_percent, low, high);
+	case CV_32F:
+		return sampleWindowRange<float>(m, low_percent, high_percent, low, high);
+	case CV_64F:
+		return sampleWindowRange<double>(m, low_percent, high_percent, low, high);
+	default:
+		return false;
+	}
+}
+
+//选框形状（不考虑反向）的逐行区间，预先求出行范围与几何参数，每行至多一段[x0,x1)
+//矩形与cv::rectangle(cv::Rect(x,y,w,h))一致；椭圆按像素中心与cv::RotatedRect同中心同轴长的椭圆解析求交
+class ShapeRows
+{
+public:
+	ShapeRows(const ImageBoxData& box, const cv::Size& size) :
+		top(0),
+		bottom(0),
+		ellipse(box.shape == ImageBoxData::Ellipse),
+		width(size.width),
+		left(0),
+		right(0),
+		cx(0.),
+		cy(0.),
+		rx(0.),
+		ry(0.)
+	{
+		if (!ellipse)
 		{
-			power = float(source_size.height()) / float(q_ptr->height());
+			cv::Rect rect(int(box.x), int(box.y), int(box.width), int(box.height));
+			if (rect.width < 0)
+			{
+				rect.x += rect.width;
+				rect.width = -rect.width;
+			}
+			if (rect.height < 0)
+			{
+				rect.y += rect.height;
+				rect.height = -rect.height;
+			}
+			rect &= cv::Rect(0, 0, size.width, size.height);
+			top = rect.y;
+			bottom = rect.y + rect.height;
+			left = rect.x;
+			right = rect.x + rect.width;
+			return;
 		}
-
-		m.setX(m.x() * power); m.setY(m.y() * power);
-		m *= 0.05;
-
-		source_position -= m;
-		source_size /= 0.95;
-
-		q_ptr->update();
+		auto r = QRectF(box.x, box.y, box.width, box.height).normalized();
+		rx = r.width() / 2.;
+		ry = r.height() / 2.;
+		if (rx <= 0. || ry <= 0.)
+			return;
+		cx = r.x() + rx;
+		cy = r.y() + ry;
+		top = std::max(0, int(std::ceil(cy - ry)));
+		bottom = std::max(top, std::min(size.height, int(std::floor(cy + ry)) + 1));
 	}
 
-	double getXPower()
+	//[top,bottom)之外的行没有区间
+	int top;
+	int bottom;
+
+	bool span(const int& y, int& x0, int& x1) const
 	{
-		return source_size.width() / q_ptr->width();
+		if (y < top || y >= bottom)
+			return false;
+		if (!ellipse)
+		{
+			x0 = left;
+			x1 = right;
+			return x0 < x1;
+		}
+		auto t = (y - cy) / ry;
+		auto hw = rx * std::sqrt(std::max(0., 1. - t * t));
+		x0 = std::max(0, int(std::ceil(cx - hw)));
+		x1 = std::min(width, int(std::floor(cx + hw)) + 1);
+		return x0 < x1;
 	}
+private:
+	bool ellipse;
+	int width;
+	int left;
+	int right;
+	double cx;
+	double cy;
+	double rx;
+	double ry;
+};
 
-	double getYPower()
+static void appendShapeSpans(const ImageBoxData& box, const cv::Size& size, std::vector<MaskSpan>& out)
+{
+	ShapeRows rows(box, size);
+	int x0, x1;
+	for (int y = rows.top; y < rows.bottom; y++)
 	{
-		return source_size.height() / q_ptr->height();
+		if (rows.span(y, x0, x1))
+		{
+			out.push_back({ y, x0, x1 });
+		}
 	}
+}
 
-	void getMovedBox(ImageBox& box, const QPoint& start_point, const QPoint& end_point)
+//按行有序、互不重叠的区间在整幅图像内取补集
+static std::vector<MaskSpan> invertSpans(const std::vector<MaskSpan>& spans, const cv::Size& size)
+{
+	std::vector<MaskSpan> out;
+	out.reserve(size_t(size.height) + spans.size());
+	size_t k = 0;
+	for (int y = 0; y < size.height; y++)
 	{
-		QPointF vec = end_point - start_point;
-		vec.setX(vec.x() * (source_size.width() / q_ptr->width()));
-		vec.setY(vec.y() * (source_size.height() / q_ptr->height()));
-		box.moveBox(vec,getImageSize());
+		int x = 0;
+		for (; k < spans.size() && spans[k].y == y; k++)
+		{
+			if (spans[k].x0 > x)
+			{
+				out.push_back({ y, x, spans[k].x0 });
+			}
+			x = std::max(x, spans[k].x1);
+		}
+		if (x < size.width)
+		{
+			out.push_back({ y, x, size.width });
+		}
 	}
+	return out;
+}
 
-	template <typename T, typename Y>
-	T getImageLine(const Y& rt)
+//由形状区间生成裁剪掩码，反向时外接矩形内形状以外为255，矩形之外也视为255
+static BoxMask spansToCroppedMask(const std::vector<MaskSpan>& spans, const bool& env)
+{
+	BoxMask out;
+	out.outside = env ? 255 : 0;
+	if (spans.empty())
+		return out;
+	int left(spans.front().x0), right(spans.front().x1);
+	for (const auto& a : spans)
 	{
-		auto p1 = getImagePosition<decltype(rt.p1())>(rt.p1());
-		auto p2 = getImagePosition<decltype(rt.p2())>(rt.p2());
-		T rtn;
-		rtn.setP1(p1);
-		rtn.setP2(p2);
-		return rtn;
+		left = std::min(left, a.x0);
+		right = std::max(right, a.x1);
 	}
-
-	template <typename T, typename Y>
-	T getPaintLine(const Y& rt)
+	int top = spans.front().y;
+	int bottom = spans.back().y + 1;
+	out.offset = cv::Point(left, top);
+	out.mask = cv::Mat(bottom - top, right - left, CV_8UC1, cv::Scalar(env ? 255 : 0));
+	for (const auto& a : spans)
 	{
-		auto p1 = getPaintPosition<decltype(rt.p1())>(rt.p1());
-		auto p2 = getPaintPosition<decltype(rt.p2())>(rt.p2());
-		T rtn;
-		rtn.setP1(p1);
-		rtn.setP2(p2);
-		return rtn;
+		auto row = out.mask.ptr<uchar>(a.y - top);
+		std::fill(row + (a.x0 - left), row + (a.x1 - left), uchar(env ? 0 : 255));
 	}
+	return out;
+}
 
-	template <typename T, typename Y>
-	T getImageRect(const Y& rt)
+//参与掩码合成与统计的选框：矩形、椭圆按值类型形状逐行解析，自定义ImageBox子类只能由getMaskSpans给出区间
+struct SelectedBox
+{
+	ImageBoxData data;
+	ImageBox* custom = nullptr;
+};
+
+//一个选框在合成中的逐行区间来源，反向选框按补集参与
+class MaskOperand
+{
+public:
+	MaskOperand(const SelectedBox& box, const cv::Size& size) :
+		rows(box.data, size),
+		env(box.data.env),
+		width(size.width),
+		height(size.height)
 	{
-		auto tl = getImagePosition<decltype(rt.topLeft())>(rt.topLeft());
-		auto br = getImagePosition<decltype(rt.bottomRight())>(rt.bottomRight());
-		T rtn;
-		rtn.setTopLeft(tl);
-		rtn.setBottomRight(br);
-		return rtn;
+		if (box.custom)
+		{
+			//自定义选框的区间已包含反向
+			spans = box.custom->getMaskSpans(QSize(size.width, size.height));
+			custom = true;
+			env = false;
+			normalizeSpans();
+		}
 	}
 
-	template <typename T, typename Y>
-	T getPaintRect(const Y& rt)
+	//可能有区间的行范围[y0,y1)
+	void rowRange(int& y0, int& y1) const
 	{
-		auto tl = getPaintPosition<decltype(rt.topLeft())>(rt.topLeft());
-		auto br = getPaintPosition<decltype(rt.bottomRight())>(rt.bottomRight());
-		T rtn;
-		rtn.setTopLeft(tl);
-		rtn.setBottomRight(br);
-		return rtn;
+		if (custom)
+		{
+			y0 = spans.empty() ? 0 : spans.front().y;
+			y1 = spans.empty() ? 0 : spans.back().y + 1;
+			return;
+		}
+		if (env)
+		{
+			y0 = 0;
+			y1 = height;
+			return;
+		}
+		y0 = rows.top;
+		y1 = rows.bottom;
 	}
 
-	template<typename T, typename Y>
-	T getPaintPosition(const Y& rt)
+	//对第y行的每个区间调用func(x0, x1)
+	template <typename F>
+	void forEachSpan(const int& y, F&& func) const
 	{
-		auto tmp_img = &(done_flag ? display_img_done : display_img);
-		double power(1.);
-		if (tmp_img->width() > tmp_img->height())
+		if (custom)
 		{
-			power = double(q_ptr->width()) / double(source_size.width());
+			auto iter = std::lower_bound(spans.begin(), spans.end(), y, [](const MaskSpan& a, const int& v) { return a.y < v; });
+			for (; iter != spans.end() && iter->y == y; iter++)
+			{
+				func(iter->x0, iter->x1);
+			}
+			return;
 		}
-		else
+		int x0(0), x1(0);
+		auto has = rows.span(y, x0, x1);
+		if (!env)
 		{
-			power = double(q_ptr->height()) / double(source_size.height());
+			if (has)
+				func(x0, x1);
+			return;
 		}
-		return T((double(rt.x()) - double(source_position.x())) * power, (double(rt.y()) - double(source_position.y())) * power);
+		if (!has)
+		{
+			func(0, width);
+			return;
+		}
+		if (x0 > 0)
+			func(0, x0);
+		if (x1 < width)
+			func(x1, width);
 	}
-	double getPower()
+private:
+	//getMaskSpans不保证有序且不重叠：裁剪到图像范围后按行排序并合并同一行重叠或相接的区间，
+	//保证每个像素在一个选框内只被计一次（交集计数、区间统计都依赖这一点）
+	void normalizeSpans()
 	{
-		auto tmp_img = &(done_flag ? display_img_done : display_img);
-		double power(1.);
-		if (tmp_img->width() > tmp_img->height())
+		std::vector<MaskSpan> out;
+		out.reserve(spans.size());
+		for (auto a : spans)
 		{
-			power = double(q_ptr->width()) / double(source_size.width());
+			a.x0 = std::max(a.x0, 0);
+			a.x1 = std::min(a.x1, width);
+			if (a.y >= 0 && a.y < height && a.x0 < a.x1)
+				out.push_back(a);
 		}
-		else
+		std::sort(out.begin(), out.end(), [](const MaskSpan& a, const MaskSpan& b) { return a.y != b.y ? a.y < b.y : a.x0 < b.x0; });
+		spans.clear();
+		for (const auto& a : out)
 		{
-			power = double(q_ptr->height()) / double(source_size.height());
+			if (!spans.empty() && spans.back().y == a.y && a.x0 <= spans.back().x1)
+			{
+				spans.back().x1 = std::max(spans.back().x1, a.x1);
+				continue;
+			}
+			spans.push_back(a);
 		}
-		return power;
 	}
 
-	template <typename T, typename Y>
-	T getImagePosition(const Y& rt)
+	ShapeRows rows;
+	bool env;
+	int width;
+	int height;
+	bool custom = false;
+	std::vector<MaskSpan> spans;
+};
+
+//选框内统计的累加器，每通道求和、平方和与极值，可选直方图
+struct RoiAccumulator
+{
+	//区间为空（high<=low）时不统计直方图，返回空的histogram
+	RoiAccumulator(const int& channels, const int& bins, const double& low, const double& high) :
+		cn(channels),
+		count(0),
+		bins(high > low ? bins : 0),
+		low(low),
+		scale(high > low ? bins / (high - low) : 0.)
 	{
-		auto tmp_img = &(done_flag ? display_img_done : display_img);
-		double power(1.);
-		if (tmp_img->width() > tmp_img->height())
+		for (int c = 0; c < 4; c++)
 		{
-			power = double(source_size.width()) / double(q_ptr->width());
+			sum[c] = 0.;
+			sq[c] = 0.;
+			min[c] = std::numeric_limits<double>::max();
+			max[c] = std::numeric_limits<double>::lowest();
 		}
-		else
+		if (bins > 0)
 		{
-			power = double(source_size.height()) / double(q_ptr->height());
+			histogram.assign(size_t(cn), std::vector<quint64>(size_t(bins), 0));
 		}
-		return T(double(rt.x()) * power + source_position.x(), double(rt.y()) * power + source_position.y());
 	}
+
+	int cn;
+	quint64 count;
+	double sum[4];
+	double sq[4];
+	double min[4];
+	double max[4];
+	int bins;
+	double low;
+	double scale;
+	std::vector<std::vector<quint64>> histogram;
 };
 
-ImageWidgetBase::ImageWidgetBase(
-#ifdef IMAGEWIDGET_QML
-	QQuickItem* parent)
-	: QQuickPaintedItem(parent),
-#else
-QWidget* parent)
-	: QWidget(parent),
-#endif // QIMAGEWIDGET_QML
-	d(new ImageWidgetBasePrivate(this))
+//逐个区间在源图上累加，内层为连续指针上的简单循环，便于编译器向量化
+template <typename T>
+static void accumulateRoi(const cv::Mat& src, const MaskOperand& op, RoiAccumulator& acc)
 {
-#ifdef IMAGEWIDGET_QML
-	setAcceptedMouseButtons(Qt::LeftButton | Qt::RightButton);
-	connect(this, &ImageWidgetBase::widthChanged, this, &ImageWidgetBase::onWidthChanged);
-	connect(this, &ImageWidgetBase::heightChanged, this, &ImageWidgetBase::onHeightChanged);
-#endif // IMAGEWIDGET_QML
-
+	int y0, y1;
+	op.rowRange(y0, y1);
+	auto cn = acc.cn;
+	for (int y = y0; y < y1; y++)
+	{
+		auto row = src.ptr<T>(y);
+		op.forEachSpan(y, [&](const int& x0, const int& x1) {
+			auto n = x1 - x0;
+			acc.count += quint64(n);
+			for (int c = 0; c < cn; c++)
+			{
+				auto p = row + size_t(x0) * cn + c;
+				double s(0.), sq(0.), mn(acc.min[c]), mx(acc.max[c]);
+				if (cn == 1)
+				{
+					for (int i = 0; i < n; i++)
+					{
+						double v = double(p[i]);
+						s += v;
+						sq += v * v;
+						mn = std::min(mn, v);
+						mx = std::max(mx, v);
+					}
+				}
+				else
+				{
+					for (int i = 0; i < n; i++)
+					{
+						double v = double(p[size_t(i) * cn]);
+						s += v;
+						sq += v * v;
+						mn = std::min(mn, v);
+						mx = std::max(mx, v);
+					}
+				}
+				acc.sum[c] += s;
+				acc.sq[c] += sq;
+				acc.min[c] = mn;
+				acc.max[c] = mx;
+				if (acc.bins > 0)
+				{
+					auto& hist = acc.histogram[c];
+					for (int i = 0; i < n; i++)
+					{
+						auto b = (double(p[size_t(i) * cn]) - acc.low) * acc.scale;
+						if (b >= 0. && b < acc.bins)
+						{
+							hist[size_t(b)]++;
+						}
+					}
+				}
+			}
+		});
+	}
 }
 
-ImageWidgetBase::~ImageWidgetBase()
+static ImageWidget::RoiStatistics roiStatistics(const cv::Mat& src, const SelectedBox& box, const int& bins, const double& low, const double& high)
 {
-	delete d;
-}
-#include <fstream>
-void ImageWidgetBase::displayCVMat(cv::Mat img)
-{
-	if (img.empty())
+	ImageWidget::RoiStatistics out;
+	out.id = box.data.id;
+	out.name = box.data.name;
+	if (src.empty() || src.channels() > 4)
+		return out;
+	MaskOperand op(box, src.size());
+	RoiAccumulator acc(src.channels(), bins, low, high);
+	switch (src.depth())
 	{
-		return;
+	case CV_8U:
+		accumulateRoi<uchar>(src, op, acc);
+		break;
+	case CV_8S:
+		accumulateRoi<schar>(src, op, acc);
+		break;
+	case CV_16U:
+		accumulateRoi<ushort>(src, op, acc);
+		break;
+	case CV_16S:
+		accumulateRoi<short>(src, op, acc);
+		break;
+	case CV_32S:
+		accumulateRoi<int>(src, op, acc);
+		break;
+	case CV_32F:
+		accumulateRoi<float>(src, op, acc);
+		break;
+	case CV_64F:
+		accumulateRoi<double>(src, op, acc);
+		break;
+	default:
+		return out;
 	}
-
-	if (d->display_img.size() != QSize(img.cols, img.rows))
+	out.count = acc.count;
+	out.histogram = std::move(acc.histogram);
+	if (acc.count == 0)
+		return out;
+	for (int c = 0; c < acc.cn; c++)
 	{
-		QPoint src_pnt;
-		QSize src_size;
-		if (float(img.cols) / float(img.rows) > float(width()) / float(height()))
-		{
-			float power = float(img.cols) / float(width());
-			auto w = float(height()) * power;
-			src_pnt.setY(-(w - float(img.rows)) / 2.);
-			src_pnt.setX(0);
-			src_size.setWidth(img.cols);
-			src_size.setHeight(w);
-		}
-		else
-		{
-
-			float power = float(img.rows) / float(height());
-			auto h = float(width()) * power;
-			src_pnt.setY(0);
-			src_pnt.setX(-(h - float(img.cols)) / 2.);
-			src_size.setWidth(h);
-			src_size.setHeight(img.rows);
-		}
-		d->source_position = src_pnt;
-		d->source_size = src_size;
+		auto mean = acc.sum[c] / double(acc.count);
+		out.mean[c] = mean;
+		out.stddev[c] = std::sqrt(std::max(0., acc.sq[c] / double(acc.count) - mean * mean));
+		out.min[c] = acc.min[c];
+		out.max[c] = acc.max[c];
 	}
-	d->display_img.detach();
-	auto qimg = d->cvMatToQImage(img);
-	d->display_img = QPixmap::fromImage(qimg);
-	qimg.detach();
-	update();
+	return out;
 }
 
-void ImageWidgetBase::displayQImage(const QImage& img)
+//各选框互相独立，按选框并行
+static std::vector<ImageWidget::RoiStatistics> roiStatistics(const cv::Mat& src, const std::vector<SelectedBox>& boxes, const int& bins, const double& low, const double& high)
 {
-	if (img.byteCount() == 0)
-	{
-		return;
-	}
-	if (d->display_img.size() != img.size())
-	{
-		QPoint src_pnt;
-		QSize src_size;
-		if (float(img.width()) / float(img.height()) > float(width()) / float(height()))
-		{
-			float power = float(img.width()) / float(width());
-			auto w = float(height()) * power;
-			src_pnt.setY(-(w - float(img.height())) / 2.);
-			src_pnt.setX(0);
-			src_size.setWidth(img.width());
-			src_size.setHeight(w);
-		}
-		else
+	std::vector<ImageWidget::RoiStatistics> out(boxes.size());
+	cv::parallel_for_(cv::Range(0, int(boxes.size())), [&](const cv::Range& range) {
+		for (int i = range.start; i < range.end; i++)
 		{
-			float power = float(img.height()) / float(height());
-			auto h = float(width()) * power;
-			src_pnt.setY(0);
-			src_pnt.setX(-(h - float(img.width())) / 2.);
-			src_size.setWidth(h);
-			src_size.setHeight(img.height());
-
+			out[size_t(i)] = roiStatistics(src, boxes[size_t(i)], bins, low, high);
 		}
-		d->source_position = src_pnt;
-		d->source_size = src_size;
-	}
-
-	d->display_img = QPixmap::fromImage(img.copy(QRect(0, 0, img.width(), img.height())));
-	update();
-}
-
-void ImageWidgetBase::displayCVMatWithData(const cv::Mat& img, const PaintData& data)
-{
-	d->paint_data = data;
-	displayCVMat(img);
+	});
+	return out;
 }
 
-void ImageWidgetBase::displayQImageWithData(const QImage& img, const PaintData& data)
+//原图的积分图与平方积分图，(rows+1)x(cols+1)，CV_64F，通道与原图一致
+struct IntegralTables
 {
-	d->paint_data = data;
-	displayQImage(img);
-}
+	cv::Mat sum;
+	cv::Mat sq;
+};
 
-void ImageWidgetBase::displayDoneCVMat(const cv::Mat& img)
+//cv::integral不支持的深度先转为CV_64F；reuse为上一帧的表，尺寸与类型一致时直接写入其缓冲，不重新分配
+static std::shared_ptr<IntegralTables> buildIntegral(const cv::Mat& src, std::shared_ptr<IntegralTables> reuse)
 {
-	if (img.empty())
+	auto out = reuse ? std::move(reuse) : std::make_shared<IntegralTables>();
+	if (src.empty() || src.dims != 2 || src.channels() > 4)
 	{
-		return;
+		out->sum.release();
+		out->sq.release();
+		return out;
 	}
-	if (d->display_img_done.size() != QSize(img.cols, img.rows))
+	if (src.depth() == CV_8S || src.depth() == CV_32S)
 	{
-		QPoint src_pnt;
-		QSize src_size;
-		if (float(img.cols) / float(img.rows) > float(width()) / float(height()))
-		{
-			float power = float(img.cols) / float(width());
-			auto w = float(height()) * power;
-			src_pnt.setY(-(w - float(img.rows)) / 2.);
-			src_pnt.setX(0);
-			src_size.setWidth(img.cols);
-			src_size.setHeight(w);
-		}
-		else
-		{
-			float power = float(img.rows) / float(height());
-			auto h = float(width()) * power;
-			src_pnt.setY(0);
-			src_pnt.setX(-(h - float(img.cols)) / 2.);
-			src_size.setWidth(h);
-			src_size.setHeight(img.rows);
+		cv::Mat tmp;
+		src.convertTo(tmp, CV_64F);
+		cv::integral(tmp, out->sum, out->sq, CV_64F, CV_64F);
+	}
+	else
+	{
+		cv::integral(src, out->sum, out->sq, CV_64F, CV_64F);
+	}
+	return out;
+}
 
-		}
-		d->source_position = src_pnt;
-		d->source_size = src_size;
+//积分图上[x0,x1)x[y0,y1)各通道的和累加到out
+static void integralRect(const cv::Mat& table, const int& x0, const int& y0, const int& x1, const int& y1, double* out)
+{
+	auto cn = table.channels();
+	auto a = table.ptr<double>(y0);
+	auto b = table.ptr<double>(y1);
+	for (int c = 0; c < cn; c++)
+	{
+		out[c] += b[x1 * cn + c] - b[x0 * cn + c] - a[x1 * cn + c] + a[x0 * cn + c];
 	}
-	d->display_img_done = QPixmap::fromImage(d->cvMatToQImage(img, true));
-	d->startDoneImageTimer();
-	update();
 }
 
-void ImageWidgetBase::displayDoneQImage(const QImage& img)
+//矩形O(1)，椭圆与自定义选框逐行区间各O(1)；反向选框用整幅图减去形状
+static ImageWidget::LiveRoiStatistics integralStatistics(const IntegralTables& tables, const SelectedBox& box)
 {
-	if (img.byteCount() == 0)
+	ImageWidget::LiveRoiStatistics out;
+	out.id = box.data.id;
+	out.name = box.data.name;
+	if (tables.sum.empty())
+		return out;
+	cv::Size size(tables.sum.cols - 1, tables.sum.rows - 1);
+	auto cn = tables.sum.channels();
+	double sum[4] = { 0., 0., 0., 0. };
+	double sq[4] = { 0., 0., 0., 0. };
+	quint64 count(0);
+	auto add = [&](const int& x0, const int& y0, const int& x1, const int& y1) {
+		integralRect(tables.sum, x0, y0, x1, y1, sum);
+		integralRect(tables.sq, x0, y0, x1, y1, sq);
+		count += quint64(x1 - x0) * quint64(y1 - y0);
+	};
+	if (box.custom)
 	{
-		return;
+		MaskOperand op(box, size);
+		int y0, y1;
+		op.rowRange(y0, y1);
+		for (int y = y0; y < y1; y++)
+		{
+			op.forEachSpan(y, [&](const int& x0, const int& x1) { add(x0, y, x1, y + 1); });
+		}
 	}
-	if (d->display_img_done.size() != img.size())
+	else
 	{
-		QPoint src_pnt;
-		QSize src_size;
-		if (img.width() > img.height())
+		ShapeRows rows(box.data, size);
+		int x0, x1;
+		if (box.data.shape == ImageBoxData::Rect)
 		{
-			float power = float(img.width()) / float(width());
-			auto w = float(height()) * power;
-			src_pnt.setY(-(w - float(img.height())) / 2.);
-			src_pnt.setX(0);
-			src_size.setWidth(img.width());
-			src_size.setHeight(w);
+			if (rows.span(rows.top, x0, x1))
+			{
+				add(x0, rows.top, x1, rows.bottom);
+			}
 		}
 		else
 		{
-			float power = float(img.height()) / float(height());
-			auto h = float(width()) * power;
-			src_pnt.setY(0);
-			src_pnt.setX(-(h - float(img.width())) / 2.);
-			src_size.setWidth(h);
-			src_size.setHeight(img.height());
-
+			for (int y = rows.top; y < rows.bottom; y++)
+			{
+				if (rows.span(y, x0, x1))
+				{
+					add(x0, y, x1, y + 1);
+				}
+			}
+		}
+		if (box.data.env)
+		{
+			double total_sum[4] = { 0., 0., 0., 0. };
+			double total_sq[4] = { 0., 0., 0., 0. };
+			integralRect(tables.sum, 0, 0, size.width, size.height, total_sum);
+			integralRect(tables.sq, 0, 0, size.width, size.height, total_sq);
+			for (int c = 0; c < cn; c++)
+			{
+				sum[c] = total_sum[c] - sum[c];
+				sq[c] = total_sq[c] - sq[c];
+			}
+			count = quint64(size.area()) - count;
 		}
-		d->source_position = src_pnt;
-		d->source_size = src_size;
 	}
-	d->display_img_done = QPixmap::fromImage(img.copy(QRect(0, 0, img.width(), img.height())));
-	d->startDoneImageTimer();
-	update();
-}
-
-void ImageWidgetBase::displayDoneCVMatWithData(const cv::Mat& img, const PaintData& data)
-{
-	d->done_paint_data = data;
-	displayCVMat(img);
-}
-
-void ImageWidgetBase::displayDoneQImageWithData(const QImage& img, const PaintData& data)
-{
-	d->done_paint_data = data;
-	displayDoneQImage(img);
+	out.count = count;
+	for (int c = 0; c < cn; c++)
+	{
+		out.sum[c] = sum[c];
+		if (count == 0)
+			continue;
+		auto mean = sum[c] / double(count);
+		out.mean[c] = mean;
+		out.variance[c] = std::max(0., sq[c] / double(count) - mean * mean);
+	}
+	return out;
 }
 
-void ImageWidgetBase::displayCVMat(QVariant img)
+//外接矩形向外取整后裁剪到图像范围，整数坐标的矩形选框与getCVRect()一致
+static ImageWidget::RoiCrop roiCrop(const cv::Mat& src, const SelectedBox& box)
 {
-	if (img.canConvert<cv::Mat>())
+	ImageWidget::RoiCrop out;
+	out.id = box.data.id;
+	out.name = box.data.name;
+	auto r = box.custom ? box.custom->getBoundingRect() : QRectF(box.data.x, box.data.y, box.data.width, box.data.height).normalized();
+	auto x0 = int(std::floor(r.left()));
+	auto y0 = int(std::floor(r.top()));
+	auto x1 = int(std::ceil(r.right()));
+	auto y1 = int(std::ceil(r.bottom()));
+	out.rect = cv::Rect(x0, y0, x1 - x0, y1 - y0) & cv::Rect(0, 0, src.cols, src.rows);
+	if (!out.rect.empty())
 	{
-		displayCVMat(img.value<cv::Mat>());
+		out.view = src(out.rect);
 	}
+	return out;
 }
 
-void ImageWidgetBase::displayQImage(const QVariant& img)
+static std::vector<ImageWidget::RoiCrop> roiCrops(const cv::Mat& src, const std::vector<SelectedBox>& boxes)
 {
-	if (img.canConvert<QImage>())
+	std::vector<ImageWidget::RoiCrop> out;
+	out.reserve(boxes.size());
+	for (const auto& a : boxes)
 	{
-		displayQImage(img.value<QImage>());
+		out.push_back(roiCrop(src, a));
 	}
+	return out;
 }
 
-void ImageWidgetBase::displayCVMatWithData(const QVariant& img, const QVariant& paint_data)
+//按规则一次扫描生成合成掩码，按行带并行；每行直接由各选框的区间写出，不生成中间掩码
+static cv::Mat composeMask(const std::vector<SelectedBox>& boxes, const int& rule, const cv::Size& size)
 {
-	if (img.canConvert<cv::Mat>() && paint_data.canConvert<PaintData>())
+	cv::Mat out(size, CV_8UC1);
+	if (size.empty())
+		return out;
+	std::vector<MaskOperand> operands;
+	operands.reserve(boxes.size());
+	for (const auto& a : boxes)
 	{
-		displayCVMatWithData(img.value<cv::Mat>(), paint_data.value<PaintData>());
+		operands.emplace_back(a, size);
 	}
+	auto bands = std::max(1., size.height / 64.);
+	cv::parallel_for_(cv::Range(0, size.height), [&](const cv::Range& range) {
+		//交集按覆盖计数判断，差分数组每个行带一份
+		std::vector<int> cover;
+		if (rule == ImageWidget::MaskIntersection)
+		{
+			cover.resize(size_t(size.width) + 1);
+		}
+		for (int y = range.start; y < range.end; y++)
+		{
+			auto row = out.ptr<uchar>(y);
+			std::memset(row, 0, size_t(size.width));
+			if (operands.empty())
+				continue;
+			switch (rule)
+			{
+			case ImageWidget::MaskIntersection:
+			{
+				std::fill(cover.begin(), cover.end(), 0);
+				for (const auto& op : operands)
+				{
+					op.forEachSpan(y, [&cover](const int& x0, const int& x1) {
+						cover[x0]++;
+						cover[x1]--;
+					});
+				}
+				int count(0);
+				auto n = int(operands.size());
+				for (int x = 0; x < size.width; x++)
+				{
+					count += cover[x];
+					row[x] = count == n ? 255 : 0;
+				}
+				break;
+			}
+			case ImageWidget::MaskSubtraction:
+				operands.front().forEachSpan(y, [row](const int& x0, const int& x1) { std::memset(row + x0, 255, size_t(x1 - x0)); });
+				for (size_t i = 1; i < operands.size(); i++)
+				{
+					operands[i].forEachSpan(y, [row](const int& x0, const int& x1) { std::memset(row + x0, 0, size_t(x1 - x0)); });
+				}
+				break;
+			default:
+				for (const auto& op : operands)
+				{
+					op.forEachSpan(y, [row](const int& x0, const int& x1) { std::memset(row + x0, 255, size_t(x1 - x0)); });
+				}
+				break;
+			}
+		}
+	}, bands);
+	return out;
 }
 
-void ImageWidgetBase::displayQImageWithData(const QVariant& img, const QVariant& paint_data)
+//按数据指针去重的像素内存统计，共享同一块内存的Mat、QImage只计一次
+class PixelLedger
 {
-	if (img.canConvert<QImage>() && paint_data.canConvert<PaintData>())
+public:
+	qint64 add(const void* data, const qint64& bytes)
 	{
-		displayQImageWithData(img.value<QImage>(), paint_data.value<PaintData>());
+		if (!data || bytes <= 0 || !seen.insert(data).second)
+			return 0;
+		return bytes;
 	}
-}
 
-void ImageWidgetBase::displayDoneCVMat(const QVariant& img)
-{
-	if (img.canConvert<cv::Mat>())
+	//ROI视图按整块分配计
+	qint64 add(const cv::Mat& m)
 	{
-		displayDoneCVMat(img.value<cv::Mat>());
+		return m.empty() ? 0 : add(m.datastart, qint64(m.dataend - m.datastart));
 	}
-}
 
-void ImageWidgetBase::displayDoneQImage(const QVariant& img)
-{
-	if (img.canConvert<QImage>())
+	qint64 add(const QImage& img)
 	{
-		displayDoneQImage(img.value<QImage>());
+		return img.isNull() ? 0 : add(img.constBits(), qint64(img.sizeInBytes()));
 	}
-}
+private:
+	std::unordered_set<const void*> seen;
+};
 
-void ImageWidgetBase::displayDoneCVMatWithData(const QVariant& img, const QVariant& paint_data)
+//按尺寸和类型分组的帧缓冲池，引用计数为1的缓冲视为空闲
+class FrameBufferPool
 {
-	if (img.canConvert<cv::Mat>() && paint_data.canConvert<PaintData>())
+public:
+	FrameBufferPool(const int& depth = 3) :
+		buffers_per_key(depth),
+		hits(0),
+		misses(0)
 	{
-		displayDoneCVMatWithData(img.value<cv::Mat>(), paint_data.value<PaintData>());
 	}
-}
 
-void ImageWidgetBase::displayDoneQImageWithData(const QVariant& img, const QVariant& paint_data)
-{
-	if (img.canConvert<QImage>() && paint_data.canConvert<PaintData>())
+	cv::Mat acquire(const int& rows, const int& cols, const int& type)
 	{
-		displayDoneQImageWithData(img.value<QImage>(), paint_data.value<PaintData>());
+		std::lock_guard<std::mutex> lock(mutex);
+		auto key = std::make_tuple(rows, cols, type);
+		auto& list = buffers[key];
+		for (auto& buf : list)
+		{
+			if (buf.u && buf.u->refcount == 1)
+			{
+				hits++;
+				return buf;
+			}
+		}
+		misses++;
+		//分辨率变化后释放其他尺寸的空闲缓冲
+		for (auto iter = buffers.begin(); iter != buffers.end();)
+		{
+			if (iter->first != key)
+			{
+				auto& other = iter->second;
+				other.erase(std::remove_if(other.begin(), other.end(), [](const cv::Mat& b) { return !b.u || b.u->refcount == 1; }), other.end());
+				if (other.empty())
+				{
+					iter = buffers.erase(iter);
+					continue;
+				}
+			}
+			iter++;
+		}
+		cv::Mat buf(rows, cols, type);
+		if (int(list.size()) < buffers_per_key)
+		{
+			list.push_back(buf);
+		}
+		return buf;
 	}
-}
 
-void ImageWidgetBase::resetScale()
-{
-	QPoint src_pnt;
-	QSize src_size;
+	void setDepth(const int& depth)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		buffers_per_key = depth < 1 ? 1 : depth;
+		for (auto& node : buffers)
+		{
+			if (int(node.second.size()) > buffers_per_key)
+			{
+				node.second.resize(buffers_per_key);
+			}
+		}
+	}
 
-	auto tmp_img = &(d->done_flag ? d->display_img_done : d->display_img);
-	if (!tmp_img->isNull())
+	//释放未被引用的缓冲
+	void releaseIdle()
 	{
-		if (float(tmp_img->width()) / float(tmp_img->height()) > float(width()) / float(height()))
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto iter = buffers.begin(); iter != buffers.end();)
 		{
-			float power = float(tmp_img->width()) / float(width());
-			auto w = float(height()) * power;
-			src_pnt.setY(-(w - float(tmp_img->height())) / 2.);
-			src_pnt.setX(0);
-			src_size.setWidth(tmp_img->width());
-			src_size.setHeight(w);
+			auto& list = iter->second;
+			list.erase(std::remove_if(list.begin(), list.end(), [](const cv::Mat& b) { return !b.u || b.u->refcount == 1; }), list.end());
+			iter = list.empty() ? buffers.erase(iter) : std::next(iter);
 		}
-		else
+	}
+
+	qint64 account(PixelLedger& ledger)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		qint64 bytes(0);
+		for (auto& node : buffers)
 		{
-			float power = float(tmp_img->height()) / float(height());
-			auto h = float(width()) * power;
-			src_pnt.setY(0);
-			src_pnt.setX(-(h - float(tmp_img->width())) / 2.);
-			src_size.setWidth(h);
-			src_size.setHeight(tmp_img->height());
+			for (auto& buf : node.second)
+			{
+				bytes += ledger.add(buf);
+			}
 		}
+		return bytes;
 	}
-	d->source_position = src_pnt;
-	d->source_size = src_size;
-	update();
 
-}
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		buffers.clear();
+	}
 
-void ImageWidgetBase::setBackgroudColor(const QColor& c)
-{
-	d->backgroudcolor = c;
-	update();
-}
+	ImageWidgetBase::BufferPoolCounters getCounters()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		ImageWidgetBase::BufferPoolCounters counters;
+		counters.hits = hits;
+		counters.misses = misses;
+		for (auto& node : buffers)
+		{
+			for (auto& buf : node.second)
+			{
+				counters.buffers++;
+				counters.bytes += buf.total() * buf.elemSize();
+			}
+		}
+		return counters;
+	}
 
-void ImageWidgetBase::mousePressEvent(QMouseEvent* e)
-{
-	d->moving = true;
-	d->start_point = e->pos();
-	update();
-}
+	void resetCounters()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		hits = 0;
+		misses = 0;
+	}
+private:
+	std::mutex mutex;
+	std::map<std::tuple<int, int, int>, std::vector<cv::Mat>> buffers;
+	int buffers_per_key;
+	quint64 hits;
+	quint64 misses;
+};
 
-void ImageWidgetBase::mouseMoveEvent(QMouseEvent* e)
+//字体名全局去重，文字只保存字体编号
+class FontFamilyTable
 {
-	if (!d->moving)
-		return;
-	auto m = QPointF(e->pos().x(),e->pos().y());
-	auto vec = m - d->start_point;
-	vec.setX(vec.x() * (d->source_size.width() / width()));
-	vec.setY(vec.y() * (d->source_size.height() / height()));
-	d->source_position.setX(d->source_position.x() - vec.x());
-	d->source_position.setY(d->source_position.y() - vec.y());
-	d->start_point = m;
-	update();
-}
+public:
+	static FontFamilyTable& instance()
+	{
+		static FontFamilyTable table;
+		return table;
+	}
+	int intern(const std::string& family)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		auto iter = ids.find(family);
+		if (iter != ids.end())
+		{
+			return iter->second;
+		}
+		auto id = int(names.size());
+		ids.emplace(family, id);
+		names.push_back(QString::fromStdString(family));
+		return id;
+	}
+	QString name(const int& id)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return id >= 0 && id < int(names.size()) ? names[id] : QString();
+	}
+private:
+	std::mutex mutex;
+	std::map<std::string, int> ids;
+	std::vector<QString> names;
+};
 
-void ImageWidgetBase::mouseReleaseEvent(QMouseEvent* e)
+
+struct StaticTextKey
 {
-	d->moving = false;
-	emit clickedPosition(d->getImagePosition<QPoint>(e->pos()));
-}
+	QString text;
+	int family_id;
+	int pixel_size;
+	bool operator==(const StaticTextKey& other) const
+	{
+		return family_id == other.family_id && pixel_size == other.pixel_size && text == other.text;
+	}
+};
 
-void ImageWidgetBase::mouseDoubleClickEvent(QMouseEvent* e)
+inline uint qHash(const StaticTextKey& key, uint seed = 0)
 {
-	resetScale();
+	return qHash(key.text, seed) ^ uint(key.family_id * 31 + key.pixel_size);
 }
-#ifdef IMAGEWIDGET_QML
-void ImageWidgetBase::onWidthChanged()
+
+//字体按(字体族,像素大小)只解析一次，文字排版按(内容,字体,像素大小)缓存为QStaticText
+class TextLayoutCache
 {
-	resetScale();
-}
+public:
+	TextLayoutCache() :
+		layouts(8192)
+	{
+	}
 
-void ImageWidgetBase::onHeightChanged()
+	int capacity() const
+	{
+		return layouts.maxCost();
+	}
+
+	void draw(QPainter* painter, const QPointF& baseline, const QString& text, const int& family_id, const int& pixel_size)
+	{
+		const auto& entry = fontOf(family_id, pixel_size);
+		StaticTextKey key{ text, family_id, pixel_size };
+		auto layout = layouts.object(key);
+		if (!layout)
+		{
+			layout = new QStaticText(text);
+			layout->setTextFormat(Qt::PlainText);
+			layout->setPerformanceHint(QStaticText::AggressiveCaching);
+			layout->prepare(QTransform(), entry.font);
+			layouts.insert(key, layout);
+		}
+		if (painter->font() != entry.font)
+		{
+			painter->setFont(entry.font);
+		}
+		//QStaticText以左上角定位，drawText以基线定位
+		painter->drawStaticText(QPointF(baseline.x(), baseline.y() - entry.ascent), *layout);
+	}
+private:
+	struct FontEntry
+	{
+		QFont font;
+		qreal ascent;
+	};
+
+	const FontEntry& fontOf(const int& family_id, const int& pixel_size)
+	{
+		auto key = (quint64(quint32(family_id)) << 32) | quint32(pixel_size);
+		auto iter = fonts.constFind(key);
+		if (iter != fonts.constEnd())
+		{
+			return iter.value();
+		}
+		QFont font;
+		font.setFamily(FontFamilyTable::instance().name(family_id));
+		font.setPixelSize(pixel_size);
+		//缺失的字体族（如Linux下的Microsoft YaHei）只回退一次，之后直接使用实际匹配到的字体族
+		font.setFamily(QFontInfo(font).family());
+		return fonts.insert(key, FontEntry{ font, QFontMetricsF(font).ascent() }).value();
+	}
+
+	QHash<quint64, FontEntry> fonts;
+	QCache<StaticTextKey, QStaticText> layouts;
+};
+
+//决定叠加层绘制结果的视口状态
+struct OverlayViewport
 {
-	resetScale();
-}
-#endif
-#ifndef IMAGEWIDGET_QML
-void ImageWidgetBase::resizeEvent(QResizeEvent* e)
+	QPointF source_position;
+	QSizeF source_size;
+	QSize widget_size;
+	QSize image_size;
+	qreal device_pixel_ratio = 1.;
+	double lod_threshold = 0.;
+	bool operator==(const OverlayViewport& other) const
+	{
+		return source_position == other.source_position && source_size == other.source_size && widget_size == other.widget_size
+			&& image_size == other.image_size && device_pixel_ratio == other.device_pixel_ratio && lod_threshold == other.lod_threshold;
+	}
+	bool operator!=(const OverlayViewport& other) const
+	{
+		return !(*this == other);
+	}
+};
+
+//按视口缓存的叠加层栅格，视口、内容和版本都不变时只贴图
+class RetainedRaster
 {
-	QWidget::resizeEvent(e);
-	resetScale();
-}
-#endif
+public:
+	RetainedRaster() :
+		revision(0),
+		valid(false)
+	{
+	}
 
-#ifdef IMAGEWIDGET_QML
-void ImageWidgetBase::paint(QPainter* painter)
-#else
-void ImageWidgetBase::paintEvent(QPaintEvent* e)
-#endif
+	void paint(QPainter* painter, const OverlayViewport& vp, const std::shared_ptr<const void>& data, const quint64& rev, const std::function<void(QPainter*)>& render)
+	{
+		if (vp.widget_size.isEmpty())
+			return;
+		if (!valid || vp != viewport || data != content || rev != revision)
+		{
+			auto size = vp.widget_size * vp.device_pixel_ratio;
+			if (image.size() != size)
+			{
+				image = QImage(size, QImage::Format_ARGB32_Premultiplied);
+			}
+			image.setDevicePixelRatio(vp.device_pixel_ratio);
+			image.fill(Qt::transparent);
+			QPainter layer_painter(&image);
+			layer_painter.setRenderHints(painter->renderHints());
+			render(&layer_painter);
+			layer_painter.end();
+			viewport = vp;
+			content = data;
+			revision = rev;
+			valid = true;
+		}
+		painter->drawImage(QPointF(0, 0), image);
+	}
+
+	void release()
+	{
+		image = QImage();
+		content.reset();
+		valid = false;
+	}
+
+	qint64 bytes() const
+	{
+		return image.sizeInBytes();
+	}
+private:
+	QImage image;
+	OverlayViewport viewport;
+	//持有已绘制的内容，保证指针比较不会因地址复用而误判
+	std::shared_ptr<const void> content;
+	quint64 revision;
+	bool valid;
+};
+
+//持久叠加层存储，各类元素存放在槽数组中，句柄由类型、代数和槽号组成，删除后槽号复用、代数递增使旧句柄失效
+//可在任意线程修改，记录变化的图像区域，绘制时只重绘这些区域
+class OverlayStore
 {
-#ifdef IMAGEWIDGET_QML
-	QPainter* painter_ptr = painter;
-#else
-	QPainter painter_obj;
-	QPainter* painter_ptr = &painter_obj;
-	painter_ptr->begin(this);
-#endif
-	painter_ptr->setBrush(QBrush(d->backgroudcolor));
-	painter_ptr->setPen(QPen(d->backgroudcolor));
-	painter_ptr->drawRect(QRect(0, 0, width(), height()));
-	auto tmp_img = &(d->done_flag ? d->display_img_done : d->display_img);
+public:
+	typedef decltype(PaintData::lines)::value_type LineItem;
+	typedef decltype(PaintData::rects)::value_type ShapeItem;
+	typedef decltype(PaintData::texts)::value_type TextItem;
+	typedef decltype(PaintData::corss_lines)::value_type CrossLineItem;
+	enum Kind
+	{
+		LineKind,
+		RectKind,
+		CircleKind,
+		TextKind,
+		CrossLineKind
+	};
+
+	OverlayStore() :
+		max_thickness(1),
+		full_dirty(false),
+		update_posted(false),
+		valid(false),
+		raster_generation(0)
+	{
+	}
+
+	std::vector<quint64> append(const PaintData& data)
+	{
+		std::vector<quint64> handles;
+		handles.reserve(data.lines.size() + data.rects.size() + data.circles.size() + data.texts.size() + data.corss_lines.size());
+		std::lock_guard<std::mutex> lock(mutex);
+		for (const auto& a : data.lines)
+			handles.push_back(insert(lines, LineKind, a));
+		for (const auto& a : data.rects)
+			handles.push_back(insert(rects, RectKind, a));
+		for (const auto& a : data.circles)
+			handles.push_back(insert(circles, CircleKind, a));
+		for (const auto& a : data.texts)
+			handles.push_back(insert(texts, TextKind, a));
+		for (const auto& a : data.corss_lines)
+			handles.push_back(insert(corss_lines, CrossLineKind, a));
+		return handles;
+	}
+
+	//每种类型的第k个句柄对应data中该类型的第k个元素
+	void update(const std::vector<quint64>& handles, const PaintData& data)
+	{
+		std::array<size_t, 5> next{};
+		std::lock_guard<std::mutex> lock(mutex);
+		for (const auto& h : handles)
+		{
+			auto kind = kindOf(h);
+			switch (kind)
+			{
+			case LineKind:
+				if (next[kind] < data.lines.size())
+					replace(lines, h, data.lines[next[kind]++]);
+				break;
+			case RectKind:
+				if (next[kind] < data.rects.size())
+					replace(rects, h, data.rects[next[kind]++]);
+				break;
+			case CircleKind:
+				if (next[kind] < data.circles.size())
+					replace(circles, h, data.circles[next[kind]++]);
+				break;
+			case TextKind:
+				if (next[kind] < data.texts.size())
+					replace(texts, h, data.texts[next[kind]++]);
+				break;
+			case CrossLineKind:
+				if (next[kind] < data.corss_lines.size())
+					replace(corss_lines, h, data.corss_lines[next[kind]++]);
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	void remove(const std::vector<quint64>& handles)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (const auto& h : handles)
+		{
+			switch (kindOf(h))
+			{
+			case LineKind:
+				erase(lines, h);
+				break;
+			case RectKind:
+				erase(rects, h);
+				break;
+			case CircleKind:
+				erase(circles, h);
+				break;
+			case TextKind:
+				erase(texts, h);
+				break;
+			case CrossLineKind:
+				erase(corss_lines, h);
+				break;
+			default:
+				break;
+			}
+		}
+	}
+
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		lines = Slots<LineItem>();
+		rects = Slots<ShapeItem>();
+		circles = Slots<ShapeItem>();
+		texts = Slots<TextItem>();
+		corss_lines = Slots<CrossLineItem>();
+		max_thickness = 1;
+		snapshot.reset();
+		dirty.clear();
+		full_dirty = true;
+		raster_generation++;
+	}
+
+	size_t count()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return lines.count + rects.count + circles.count + texts.count + corss_lines.count;
+	}
+
+	//释放栅格，下次绘制时整体重绘
+	void releaseRaster()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		image = QImage();
+		valid = false;
+		raster_generation++;
+	}
+
+	qint64 rasterBytes()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return image.sizeInBytes();
+	}
+
+	//有未处理的变化且尚未投递刷新时返回true，调用方负责投递
+	bool takeUpdatePost()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		if (update_posted || (!full_dirty && dirty.empty()))
+			return false;
+		update_posted = true;
+		return true;
+	}
+
+	//待刷新的绘制区域，full为true时需要整体刷新
+	QRegion takeUpdateRegion(const QTransform& transform, bool& full)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		update_posted = false;
+		full = full_dirty;
+		QRegion region;
+		if (!full)
+		{
+			for (const auto& rect : dirty)
+			{
+				region += paintRectOf(rect, transform);
+			}
+		}
+		return region;
+	}
+
+	//视口变化时整体重绘（使用缓存的全量快照），否则只在变化区域内清除并重绘与之相交的元素；
+	//锁内只取快照或相交子集，绘制在锁外进行，不阻塞生产线程的增删改
+	void paint(QPainter* painter, const OverlayViewport& vp, const QTransform& transform, const std::function<void(QPainter*, const PaintData&)>& render)
+	{
+		if (vp.widget_size.isEmpty())
+			return;
+		auto size = vp.widget_size * vp.device_pixel_ratio;
+		bool full = false;
+		std::shared_ptr<PaintData> data;
+		QRegion region;
+		QImage layer;
+		quint64 generation;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			generation = raster_generation;
+			if (lines.count + rects.count + circles.count + texts.count + corss_lines.count == 0 && !full_dirty && dirty.empty())
+			{
+				return;
+			}
+			full = !valid || full_dirty || vp != viewport || image.size() != size;
+			if (full)
+			{
+				if (!snapshot)
+				{
+					snapshot = std::make_shared<PaintData>();
+					collect(*snapshot, nullptr, transform);
+				}
+				data = snapshot;
+			}
+			else if (!dirty.empty())
+			{
+				for (const auto& rect : dirty)
+				{
+					region += paintRectOf(rect, transform);
+				}
+				data = std::make_shared<PaintData>();
+				collect(*data, &dirty, transform);
+			}
+			full_dirty = false;
+			dirty.clear();
+			layer.swap(image);
+		}
+		if (data)
+		{
+			if (layer.size() != size)
+			{
+				layer = QImage(size, QImage::Format_ARGB32_Premultiplied);
+			}
+			layer.setDevicePixelRatio(vp.device_pixel_ratio);
+			QPainter layer_painter(&layer);
+			layer_painter.setRenderHints(painter->renderHints());
+			if (full)
+			{
+				layer.fill(Qt::transparent);
+			}
+			else
+			{
+				layer_painter.setClipRegion(region);
+				layer_painter.setCompositionMode(QPainter::CompositionMode_Source);
+				layer_painter.fillRect(region.boundingRect(), Qt::transparent);
+				layer_painter.setCompositionMode(QPainter::CompositionMode_SourceOver);
+			}
+			render(&layer_painter, *data);
+			layer_painter.end();
+		}
+		painter->drawImage(QPointF(0, 0), layer);
+		std::lock_guard<std::mutex> lock(mutex);
+		//绘制期间栅格被释放或整体失效时丢弃本次结果，下次整体重绘
+		if (generation != raster_generation)
+		{
+			valid = false;
+			return;
+		}
+		image.swap(layer);
+		if (data)
+		{
+			viewport = vp;
+			valid = true;
+		}
+	}
+private:
+	template <typename T>
+	struct Slots
+	{
+		std::vector<T> items;
+		std::vector<QRectF> bounds;
+		std::vector<quint32> generations;
+		std::vector<char> alive;
+		std::vector<quint32> free_slots;
+		size_t count = 0;
+	};
+
+	static quint64 makeHandle(const int& kind, const quint32& generation, const quint32& slot)
+	{
+		return (quint64(kind + 1) << 56) | (quint64(generation & 0xFFFFFF) << 32) | quint64(slot);
+	}
+
+	static int kindOf(const quint64& handle)
+	{
+		return int(handle >> 56) - 1;
+	}
+
+	static QRectF boundsOf(const LineItem& a)
+	{
+		const auto& p1 = std::get<0>(a);
+		const auto& p2 = std::get<1>(a);
+		return QRectF(QPointF(p1.x, p1.y), QPointF(p2.x, p2.y)).normalized();
+	}
+
+	static QRectF boundsOf(const ShapeItem& a)
+	{
+		const auto& r = std::get<0>(a);
+		return QRectF(r.x, r.y, r.width, r.height).normalized();
+	}
+
+	static QRectF boundsOf(const TextItem& a)
+	{
+		//与PaintDataBatch一致，宽度按字符数估计
+		const auto& pos = std::get<1>(a);
+		auto h = double(std::max(1, std::get<2>(a)));
+		return QRectF(pos.x, pos.y - h, h * std::max<size_t>(1, std::get<0>(a).size()), h * 1.5);
+	}
+
+	static QRectF boundsOf(const CrossLineItem& a)
+	{
+		const auto& c = std::get<0>(a);
+		auto wh = double(std::get<1>(a));
+		return QRectF(c.x - wh / 2., c.y - wh / 2., wh, wh);
+	}
+
+	static int thicknessOf(const LineItem& a)
+	{
+		return std::get<2>(a);
+	}
+
+	static int thicknessOf(const ShapeItem& a)
+	{
+		return std::get<1>(a);
+	}
+
+	static int thicknessOf(const TextItem&)
+	{
+		return 1;
+	}
+
+	static int thicknessOf(const CrossLineItem& a)
+	{
+		return std::get<2>(a);
+	}
+
+	//线宽按屏幕像素绘制，外扩后覆盖线宽与抗锯齿
+	QRect paintRectOf(const QRectF& rect, const QTransform& transform) const
+	{
+		auto margin = max_thickness + 2;
+		return transform.mapRect(rect).toAlignedRect().adjusted(-margin, -margin, margin, margin);
+	}
+
+	void markDirty(const QRectF& rect)
+	{
+		snapshot.reset();
+		if (full_dirty)
+			return;
+		//零散区域过多时整体重绘更省
+		if (dirty.size() >= 256)
+		{
+			dirty.clear();
+			full_dirty = true;
+			return;
+		}
+		dirty.push_back(rect);
+	}
+
+	template <typename T>
+	quint64 insert(Slots<T>& s, const int& kind, const T& item)
+	{
+		quint32 slot;
+		if (!s.free_slots.empty())
+		{
+			slot = s.free_slots.back();
+			s.free_slots.pop_back();
+			s.items[slot] = item;
+			s.bounds[slot] = boundsOf(item);
+			s.alive[slot] = 1;
+		}
+		else
+		{
+			slot = quint32(s.items.size());
+			s.items.push_back(item);
+			s.bounds.push_back(boundsOf(item));
+			s.generations.push_back(1);
+			s.alive.push_back(1);
+		}
+		s.count++;
+		max_thickness = std::max(max_thickness, thicknessOf(item));
+		markDirty(s.bounds[slot]);
+		return makeHandle(kind, s.generations[slot], slot);
+	}
+
+	template <typename T>
+	bool find(const Slots<T>& s, const quint64& handle, quint32& slot) const
+	{
+		slot = quint32(handle);
+		return slot < s.items.size() && s.alive[slot] && (s.generations[slot] & 0xFFFFFF) == quint32((handle >> 32) & 0xFFFFFF);
+	}
+
+	template <typename T>
+	void replace(Slots<T>& s, const quint64& handle, const T& item)
+	{
+		quint32 slot;
+		if (!find(s, handle, slot))
+			return;
+		markDirty(s.bounds[slot]);
+		s.items[slot] = item;
+		s.bounds[slot] = boundsOf(item);
+		max_thickness = std::max(max_thickness, thicknessOf(item));
+		markDirty(s.bounds[slot]);
+	}
+
+	template <typename T>
+	void erase(Slots<T>& s, const quint64& handle)
+	{
+		quint32 slot;
+		if (!find(s, handle, slot))
+			return;
+		markDirty(s.bounds[slot]);
+		s.items[slot] = T();
+		s.alive[slot] = 0;
+		s.generations[slot] = (s.generations[slot] + 1) & 0xFFFFFF;
+		if (s.generations[slot] == 0)
+		{
+			s.generations[slot] = 1;
+		}
+		s.free_slots.push_back(slot);
+		s.count--;
+	}
+
+	//region为空时收集全部元素，否则只收集与其中任一区域相交的元素
+	template <typename T>
+	static void collectSlots(const Slots<T>& s, std::vector<T>& out, const std::vector<QRectF>* region, const double& margin)
+	{
+		out.reserve(out.size() + (region ? 0 : s.count));
+		for (size_t i = 0; i < s.items.size(); i++)
+		{
+			if (!s.alive[i])
+				continue;
+			if (region)
+			{
+				auto b = s.bounds[i].adjusted(-margin, -margin, margin, margin);
+				bool hit = std::any_of(region->begin(), region->end(), [&b](const QRectF& r) { return b.intersects(r.adjusted(-1e-6, -1e-6, 1e-6, 1e-6)); });
+				if (!hit)
+					continue;
+			}
+			out.push_back(s.items[i]);
+		}
+	}
+
+	void collect(PaintData& out, const std::vector<QRectF>* region, const QTransform& transform) const
+	{
+		auto power = std::max(std::abs(transform.m11()), 1e-9);
+		auto margin = (max_thickness + 2) / power;
+		collectSlots(lines, out.lines, region, margin);
+		collectSlots(rects, out.rects, region, margin);
+		collectSlots(circles, out.circles, region, margin);
+		collectSlots(texts, out.texts, region, margin);
+		collectSlots(corss_lines, out.corss_lines, region, margin);
+	}
+
+	std::mutex mutex;
+	Slots<LineItem> lines;
+	Slots<ShapeItem> rects;
+	Slots<ShapeItem> circles;
+	Slots<TextItem> texts;
+	Slots<CrossLineItem> corss_lines;
+	int max_thickness;
+	//全部元素的快照，视口变化时整体重绘复用，其分组缓存也随之复用
+	std::shared_ptr<PaintData> snapshot;
+	std::vector<QRectF> dirty;
+	bool full_dirty;
+	bool update_posted;
+	QImage image;
+	OverlayViewport viewport;
+	bool valid;
+	//releaseRaster、clear时递增，paint据此判断锁外绘制期间栅格是否已失效
+	quint64 raster_generation;
+};
+
+//单生产者单消费者的有界环形队列，两端都不加锁，满时push失败
+template <typename T>
+class SpscRing
+{
+public:
+	explicit SpscRing(const size_t& capacity) :
+		slots(capacity + 1),
+		head(0),
+		tail(0)
+	{
+	}
+
+	bool push(T&& value)
+	{
+		auto t = tail.load(std::memory_order_relaxed);
+		auto next = (t + 1) % slots.size();
+		if (next == head.load(std::memory_order_acquire))
+			return false;
+		slots[t] = std::move(value);
+		tail.store(next, std::memory_order_release);
+		return true;
+	}
+
+	bool pop(T& value)
+	{
+		auto h = head.load(std::memory_order_relaxed);
+		if (h == tail.load(std::memory_order_acquire))
+			return false;
+		value = std::move(slots[h]);
+		slots[h] = T();
+		head.store((h + 1) % slots.size(), std::memory_order_release);
+		return true;
+	}
+private:
+	std::vector<T> slots;
+	std::atomic<size_t> head;
+	std::atomic<size_t> tail;
+};
+
+//overlay.bin：文件头为魔数与版本，之后每帧一条记录（序号、时间戳、分段内帧号、PaintData、选框），均为QDataStream编码
+//选框前有一字节标记，为1时与本分段上一条记录相同，不再写出列表
+const quint32 record_magic = 0x49575243;
+const quint32 record_version = 2;
+
+template <typename T, typename F>
+static void writeRecordList(QDataStream& s, const std::vector<T>& in, F&& write)
+{
+	s << quint32(in.size());
+	for (const auto& a : in)
+	{
+		write(a);
+	}
+}
+
+//按流状态逐条读取，计数损坏时不会预先分配过大内存
+template <typename T, typename F>
+static void readRecordList(QDataStream& s, std::vector<T>& out, F&& read)
+{
+	quint32 n(0);
+	s >> n;
+	out.clear();
+	out.reserve(std::min<quint32>(n, 4096));
+	for (quint32 i = 0; i < n && s.status() == QDataStream::Ok; i++)
+	{
+		T v;
+		read(v);
+		out.push_back(std::move(v));
+	}
+}
+
+static void writeRecordPoint(QDataStream& s, const cv::Point2d& p)
+{
+	s << p.x << p.y;
+}
+
+static void readRecordPoint(QDataStream& s, cv::Point2d& p)
+{
+	s >> p.x >> p.y;
+}
+
+static void writeRecordRect(QDataStream& s, const cv::Rect2d& r)
+{
+	s << r.x << r.y << r.width << r.height;
+}
+
+static void readRecordRect(QDataStream& s, cv::Rect2d& r)
+{
+	s >> r.x >> r.y >> r.width >> r.height;
+}
+
+static void writeRecordScalar(QDataStream& s, const cv::Scalar& v)
+{
+	s << v[0] << v[1] << v[2] << v[3];
+}
+
+static void readRecordScalar(QDataStream& s, cv::Scalar& v)
+{
+	s >> v[0] >> v[1] >> v[2] >> v[3];
+}
+
+static void writeRecordInt(QDataStream& s, const int& v)
+{
+	s << qint32(v);
+}
+
+static void readRecordInt(QDataStream& s, int& v)
+{
+	qint32 tmp(0);
+	s >> tmp;
+	v = tmp;
+}
+
+static void writeRecordString(QDataStream& s, const std::string& v)
+{
+	s << QByteArray::fromStdString(v);
+}
+
+static void readRecordString(QDataStream& s, std::string& v)
+{
+	QByteArray tmp;
+	s >> tmp;
+	v = tmp.toStdString();
+}
+
+static void writeRecordPaintData(QDataStream& s, const PaintData& data)
+{
+	writeRecordList(s, data.lines, [&s](const std::tuple<cv::Point2d, cv::Point2d, int, cv::Scalar>& a) {
+		writeRecordPoint(s, std::get<0>(a));
+		writeRecordPoint(s, std::get<1>(a));
+		writeRecordInt(s, std::get<2>(a));
+		writeRecordScalar(s, std::get<3>(a));
+	});
+	auto write_rect = [&s](const std::tuple<cv::Rect2d, int, cv::Scalar>& a) {
+		writeRecordRect(s, std::get<0>(a));
+		writeRecordInt(s, std::get<1>(a));
+		writeRecordScalar(s, std::get<2>(a));
+	};
+	writeRecordList(s, data.rects, write_rect);
+	writeRecordList(s, data.circles, write_rect);
+	writeRecordList(s, data.texts, [&s](const std::tuple<std::string, cv::Point2d, int, std::string, cv::Scalar>& a) {
+		writeRecordString(s, std::get<0>(a));
+		writeRecordPoint(s, std::get<1>(a));
+		writeRecordInt(s, std::get<2>(a));
+		writeRecordString(s, std::get<3>(a));
+		writeRecordScalar(s, std::get<4>(a));
+	});
+	writeRecordList(s, data.corss_lines, [&s](const std::tuple<cv::Point2d, int, int, cv::Scalar>& a) {
+		writeRecordPoint(s, std::get<0>(a));
+		writeRecordInt(s, std::get<1>(a));
+		writeRecordInt(s, std::get<2>(a));
+		writeRecordScalar(s, std::get<3>(a));
+	});
+}
+
+static void readRecordPaintData(QDataStream& s, PaintData& data)
+{
+	readRecordList(s, data.lines, [&s](std::tuple<cv::Point2d, cv::Point2d, int, cv::Scalar>& a) {
+		readRecordPoint(s, std::get<0>(a));
+		readRecordPoint(s, std::get<1>(a));
+		readRecordInt(s, std::get<2>(a));
+		readRecordScalar(s, std::get<3>(a));
+	});
+	auto read_rect = [&s](std::tuple<cv::Rect2d, int, cv::Scalar>& a) {
+		readRecordRect(s, std::get<0>(a));
+		readRecordInt(s, std::get<1>(a));
+		readRecordScalar(s, std::get<2>(a));
+	};
+	readRecordList(s, data.rects, read_rect);
+	readRecordList(s, data.circles, read_rect);
+	readRecordList(s, data.texts, [&s](std::tuple<std::string, cv::Point2d, int, std::string, cv::Scalar>& a) {
+		readRecordString(s, std::get<0>(a));
+		readRecordPoint(s, std::get<1>(a));
+		readRecordInt(s, std::get<2>(a));
+		readRecordString(s, std::get<3>(a));
+		readRecordScalar(s, std::get<4>(a));
+	});
+	readRecordList(s, data.corss_lines, [&s](std::tuple<cv::Point2d, int, int, cv::Scalar>& a) {
+		readRecordPoint(s, std::get<0>(a));
+		readRecordInt(s, std::get<1>(a));
+		readRecordInt(s, std::get<2>(a));
+		readRecordScalar(s, std::get<3>(a));
+	});
+}
+
+static void writeRecordBoxes(QDataStream& s, const std::vector<ImageBoxData>& boxes)
+{
+	writeRecordList(s, boxes, [&s](const ImageBoxData& a) {
+		s << qint32(a.shape) << qint32(a.id) << a.name << a.x << a.y << a.width << a.height << quint32(a.color.rgba()) << a.display << a.env;
+	});
+}
+
+static void readRecordBoxes(QDataStream& s, std::vector<ImageBoxData>& boxes)
+{
+	readRecordList(s, boxes, [&s](ImageBoxData& a) {
+		qint32 shape(0), id(-1);
+		quint32 rgba(0);
+		s >> shape >> id >> a.name >> a.x >> a.y >> a.width >> a.height >> rgba >> a.display >> a.env;
+		a.shape = shape == ImageBoxData::Ellipse ? ImageBoxData::Ellipse : ImageBoxData::Rect;
+		a.id = id;
+		a.color = QColor::fromRgba(rgba);
+	});
+}
+
+//入队的显示帧，只持有引用计数快照
+struct RecordFrame
+{
+	QImage image;
+	PaintDataPtr data;
+	std::shared_ptr<const std::vector<ImageBoxData>> boxes;
+	quint64 index = 0;
+	qint64 timestamp = 0;
+	qint64 bytes = 0;
+};
+
+//录制的写入端，显示线程只调用push与stop，其余都在写入线程中执行
+//每个分段一个目录，包含图像序列或视频文件以及overlay.bin
+//队列同时按帧数与字节数限制，pinned_bytes为队列中尚未写完的帧持有的图像字节
+class FrameRecorder
+{
+public:
+	FrameRecorder(const QString& dir, const QString& format, const int& capacity, const qint64& capacity_bytes, const double& fps, const int& segment_seconds, const int& keep_seconds) :
+		queued(0),
+		written(0),
+		dropped(0),
+		pinned_bytes(0),
+		throttled(false),
+		ring(size_t(std::max(1, capacity))),
+		max_bytes(capacity_bytes),
+		stopping(false),
+		dir(dir),
+		format(format.toLower()),
+		video(isVideoFormat(format)),
+		fps(fps > 0. ? fps : 25.),
+		segment_ms(qint64(std::max(1, segment_seconds)) * 1000),
+		keep_ms(qint64(std::max(0, keep_seconds)) * 1000),
+		segment_open(false),
+		segment_count(0),
+		segment_start(0),
+		segment_frames(0),
+		frame_type(-1)
+	{
+	}
+
+	static bool isVideoFormat(const QString& format)
+	{
+		auto f = format.toLower();
+		return f == "avi" || f == "mp4";
+	}
+
+	static bool isSupportedFormat(const QString& format)
+	{
+		static const QStringList image_formats = { "jpg", "jpeg", "png", "bmp", "tif", "tiff" };
+		return isVideoFormat(format) || image_formats.contains(format.toLower());
+	}
+
+	//队列满或超出字节上限时丢弃该帧，不等待
+	void push(RecordFrame&& frame)
+	{
+		if (stopping)
+			return;
+		frame.bytes = frame.image.sizeInBytes();
+		auto bytes = frame.bytes;
+		//像素预算不足时队列中最多一帧
+		auto limit = throttled ? qint64(1) : max_bytes;
+		if (limit > 0 && pinned_bytes > 0 && pinned_bytes + bytes > limit)
+		{
+			dropped++;
+			return;
+		}
+		//先计入再入队，写入线程出队后扣除，计数不会为负
+		pinned_bytes += bytes;
+		if (ring.push(std::move(frame)))
+		{
+			queued++;
+			wake.notify_one();
+		}
+		else
+		{
+			pinned_bytes -= bytes;
+			dropped++;
+		}
+	}
+
+	void stop()
+	{
+		stopping = true;
+		wake.notify_one();
+	}
+
+	//写入线程主循环，stop后写完队列中剩余的帧再退出
+	void run()
+	{
+		RecordFrame frame;
+		while (true)
+		{
+			if (ring.pop(frame))
+			{
+				writeFrame(frame);
+				pinned_bytes -= frame.bytes;
+				frame = RecordFrame();
+				continue;
+			}
+			if (stopping)
+				break;
+			//push不加锁通知，可能错过唤醒，由超时兜底
+			std::unique_lock<std::mutex> lock(wake_mutex);
+			wake.wait_for(lock, std::chrono::milliseconds(20));
+		}
+		while (ring.pop(frame))
+		{
+			writeFrame(frame);
+			pinned_bytes -= frame.bytes;
+			frame = RecordFrame();
+		}
+		closeSegment();
+	}
+
+	std::atomic<quint64> queued;
+	std::atomic<quint64> written;
+	std::atomic<quint64> dropped;
+	std::atomic<qint64> pinned_bytes;
+	std::atomic<bool> throttled;
+private:
+	void writeFrame(const RecordFrame& frame)
+	{
+		if (frame.image.isNull())
+			return;
+		auto gray = frame.image.format() == QImage::Format_Grayscale8;
+		auto img = gray ? frame.image : frame.image.convertToFormat(QImage::Format_RGB888);
+		cv::Mat view(img.height(), img.width(), gray ? CV_8UC1 : CV_8UC3, const_cast<uchar*>(img.constBits()), size_t(img.bytesPerLine()));
+		cv::Mat mat;
+		if (gray)
+		{
+			mat = view;
+		}
+		else
+		{
+			cv::cvtColor(view, mat, cv::COLOR_RGB2BGR);
+		}
+		//视频文件的尺寸与通道固定，变化时换新分段
+		if (!segment_open || frame.timestamp - segment_start >= segment_ms || (video && (mat.size() != frame_size || mat.type() != frame_type)))
+		{
+			openSegment(frame.timestamp, mat);
+		}
+		bool ok(false);
+		try
+		{
+			if (video)
+			{
+				if (writer.isOpened())
+				{
+					writer.write(mat);
+					ok = true;
+				}
+			}
+			else
+			{
+				auto file = QDir(segment_dir).filePath(QString("%1.%2").arg(segment_frames, 8, 10, QChar('0')).arg(format));
+				ok = cv::imwrite(file.toStdString(), mat);
+			}
+		}
+		catch (const cv::Exception&)
+		{
+			ok = false;
+		}
+		if (!ok)
+		{
+			dropped++;
+			return;
+		}
+		if (sidecar.isOpen())
+		{
+			static const PaintData empty_data;
+			static const std::vector<ImageBoxData> empty_boxes;
+			stream << frame.index << frame.timestamp << qint32(segment_frames);
+			writeRecordPaintData(stream, frame.data ? *frame.data : empty_data);
+			//选框没有变化时快照是同一个对象，只写标记
+			bool unchanged = segment_frames > 0 && frame.boxes == last_boxes;
+			stream << quint8(unchanged ? 1 : 0);
+			if (!unchanged)
+			{
+				writeRecordBoxes(stream, frame.boxes ? *frame.boxes : empty_boxes);
+				last_boxes = frame.boxes;
+			}
+		}
+		segment_frames++;
+		written++;
+	}
+
+	void openSegment(const qint64& timestamp, const cv::Mat& mat)
+	{
+		closeSegment();
+		auto name = QString("%1-%2").arg(QDateTime::fromMSecsSinceEpoch(timestamp).toString("yyyyMMdd-hhmmss-zzz")).arg(segment_count++);
+		segment_dir = QDir(dir).filePath(name);
+		QDir().mkpath(segment_dir);
+		segment_open = true;
+		segment_start = timestamp;
+		segment_frames = 0;
+		if (video)
+		{
+			auto fourcc = format == "mp4" ? cv::VideoWriter::fourcc('m', 'p', '4', 'v') : cv::VideoWriter::fourcc('M', 'J', 'P', 'G');
+			try
+			{
+				writer.open(QDir(segment_dir).filePath("frames." + format).toStdString(), fourcc, fps, mat.size(), mat.channels() != 1);
+			}
+			catch (const cv::Exception&)
+			{
+			}
+			frame_size = mat.size();
+			frame_type = mat.type();
+		}
+		sidecar.setFileName(QDir(segment_dir).filePath("overlay.bin"));
+		if (sidecar.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		{
+			stream.setDevice(&sidecar);
+			stream.setVersion(QDataStream::Qt_5_6);
+			stream << record_magic << record_version;
+		}
+		segments.emplace_back(segment_dir, timestamp);
+		pruneSegments(timestamp);
+	}
+
+	void closeSegment()
+	{
+		if (writer.isOpened())
+		{
+			writer.release();
+		}
+		if (sidecar.isOpen())
+		{
+			stream.setDevice(nullptr);
+			sidecar.close();
+		}
+		segment_open = false;
+	}
+
+	//后一分段的开始时间已在保留窗口之前时，前一分段整体删除
+	void pruneSegments(const qint64& now)
+	{
+		if (keep_ms <= 0)
+			return;
+		while (segments.size() > 1 && segments[1].second <= now - keep_ms)
+		{
+			QDir(segments.front().first).removeRecursively();
+			segments.pop_front();
+		}
+	}
+
+	SpscRing<RecordFrame> ring;
+	qint64 max_bytes;
+	std::mutex wake_mutex;
+	std::condition_variable wake;
+	std::atomic<bool> stopping;
+	QString dir;
+	QString format;
+	bool video;
+	double fps;
+	qint64 segment_ms;
+	qint64 keep_ms;
+	bool segment_open;
+	int segment_count;
+	QString segment_dir;
+	qint64 segment_start;
+	int segment_frames;
+	std::deque<std::pair<QString, qint64>> segments;
+	cv::VideoWriter writer;
+	cv::Size frame_size;
+	int frame_type;
+	QFile sidecar;
+	QDataStream stream;
+	std::shared_ptr<const std::vector<ImageBoxData>> last_boxes;
+};
+
+//进程内所有控件的像素内存登记与全局预算，只在GUI线程中访问
+class PixelMemoryRegistry
+{
+public:
+	static PixelMemoryRegistry& instance()
+	{
+		static PixelMemoryRegistry registry;
+		return registry;
+	}
+	std::vector<ImageWidgetBasePrivate*> widgets;
+	qint64 budget = 0;
+	//裁减时会修改其他控件，防止重入
+	bool enforcing = false;
+};
+
+//历史中的一帧，较旧的帧只保留缩小的image或压缩后的encoded，size为原始尺寸
+//source为该帧的原图，只有未缩小的帧保留，暂停时导出与ROI统计使用
+struct HistoryFrame
+{
+	QImage image;
+	QByteArray encoded;
+	cv::Mat source;
+	quint64 source_serial = 0;
+	QSize size;
+	PaintDataPtr data;
+	quint64 serial = 0;
+	qint64 bytes = 0;
+	bool degraded = false;
+
+	//与显示图像共享内存的原图不重复计入
+	qint64 pixelBytes() const
+	{
+		auto out = qint64(image.sizeInBytes()) + encoded.size();
+		if (!source.empty() && source.datastart != image.constBits())
+		{
+			out += qint64(source.dataend - source.datastart);
+		}
+		return out;
+	}
+};
+
+class ImageWidgetBasePrivate : public QObject
+{
+	Q_OBJECT
+public:
+	ImageWidgetBasePrivate(ImageWidgetBase* parent) :
+		q_ptr(parent),
+		done_flag(false),
+		log_zoom(1.),
+		moving(false),
+		backgroudcolor(125,125,125),
+		source_image_key(0),
+		source_serial(0),
+		ingest_running(false),
+		ingest_stopping(false),
+		present_posted(false),
+		frames_submitted(0),
+		frames_converted(0),
+		frames_dropped(0),
+		frames_presented(0),
+		pyramid_threshold(pyramid_default_threshold),
+		pyramid_source_key(0),
+		pyramid_request_key(0),
+		pyramid_running(false),
+		pyramid_stopping(false),
+		tile_cache(128 * 1024),
+		integral_source_serial(0),
+		integral_request_serial(0),
+		integral_running(false),
+		integral_stopping(false),
+		export_next_id(0),
+		export_pending(0),
+		export_png_compression(3),
+		export_jpeg_quality(95),
+		present_index(0),
+		recording(false),
+		history_budget(0),
+		history_full_frames(8),
+		history_scale(0.5),
+		history_compress(false),
+		history_bytes(0),
+		history_serial(0),
+		history_degrading(0),
+		live_paused(false),
+		history_offset(0),
+		history_source_serial(0),
+		pixel_budget(0),
+		parked(false),
+		work_bytes(0),
+		window_width(65535.),
+		window_level(32767.5),
+		auto_window(true),
+		auto_window_low(0.5),
+		auto_window_high(99.5),
+		lut_window(0.),
+		lut_level(0.),
+		overlay_lod_threshold(1.)
+	{
+		connect(&done_timer, &QTimer::timeout, this, &ImageWidgetBasePrivate::doneImageTimerTimeout);
+		ingest_pool.setMaxThreadCount(1);
+		pyramid_pool.setMaxThreadCount(1);
+		integral_pool.setMaxThreadCount(1);
+		export_pool.setMaxThreadCount(1);
+		record_pool.setMaxThreadCount(1);
+		history_pool.setMaxThreadCount(1);
+		PixelMemoryRegistry::instance().widgets.push_back(this);
+	}
+	~ImageWidgetBasePrivate()
+	{
+		{
+			std::lock_guard<std::mutex> lock(ingest_mutex);
+			ingest_stopping = true;
+			pending_frame.reset();
+		}
+		{
+			std::lock_guard<std::mutex> lock(pyramid_mutex);
+			pyramid_stopping = true;
+			pending_pyramid = QImage();
+		}
+		{
+			std::lock_guard<std::mutex> lock(integral_mutex);
+			integral_stopping = true;
+			pending_integral.release();
+			pending_integral_spare.reset();
+		}
+		ingest_pool.waitForDone();
+		pyramid_pool.waitForDone();
+		integral_pool.waitForDone();
+		//已提交的导出全部写完
+		export_pool.waitForDone();
+		if (recorder)
+		{
+			recorder->stop();
+		}
+		record_pool.waitForDone();
+		history_pool.waitForDone();
+		auto& widgets = PixelMemoryRegistry::instance().widgets;
+		widgets.erase(std::remove(widgets.begin(), widgets.end(), this), widgets.end());
+	}
+signals:
+	void integralReady();
+private:
+	friend ImageWidgetBase;
+	friend ImageWidget;
+	ImageWidgetBase* q_ptr;
+	FrameBufferPool buffer_pool;
+	//历史与录制持有的自有快照缓冲
+	FrameBufferPool snapshot_buffers;
+	QImage display_img;
+	QImage display_img_done;
+	QTimer done_timer;
+	bool done_flag;
+	double log_zoom;
+	QPointF start_point;
+	QPointF source_position;
+	QSizeF source_size;
+	bool moving;
+	PaintDataPtr done_paint_data;
+	PaintDataPtr paint_data;
+	QColor backgroudcolor;
+	cv::Mat source_mat;
+	qint64 source_image_key;
+	//source_mat每次更换时递增，积分图按此区分帧
+	quint64 source_serial;
+
+	struct IngestFrame
+	{
+		cv::Mat mat;
+		QImage image;
+		PaintDataPtr paint_data;
+		bool has_data = false;
+	};
+	std::mutex ingest_mutex;
+	std::optional<IngestFrame> pending_frame;
+	std::optional<IngestFrame> converted_frame;
+	bool ingest_running;
+	bool ingest_stopping;
+	bool present_posted;
+	QThreadPool ingest_pool;
+	std::atomic<quint64> frames_submitted;
+	std::atomic<quint64> frames_converted;
+	std::atomic<quint64> frames_dropped;
+	std::atomic<quint64> frames_presented;
+
+	qint64 pyramid_threshold;
+	qint64 pyramid_source_key;
+	std::vector<QImage> pyramid_levels;
+	std::mutex pyramid_mutex;
+	qint64 pyramid_request_key;
+	QImage pending_pyramid;
+	bool pyramid_running;
+	bool pyramid_stopping;
+	QThreadPool pyramid_pool;
+	//缓存单位为KB
+	QCache<quint64, QImage> tile_cache;
+
+	//积分图只在有人查询时按帧构建一次
+	quint64 integral_source_serial;
+	std::shared_ptr<IntegralTables> integral_tables;
+	//上一帧不再被引用的表，下次构建时复用其缓冲
+	std::shared_ptr<IntegralTables> integral_spare;
+	std::mutex integral_mutex;
+	quint64 integral_request_serial;
+	cv::Mat pending_integral;
+	std::shared_ptr<IntegralTables> pending_integral_spare;
+	bool integral_running;
+	bool integral_stopping;
+	QThreadPool integral_pool;
+
+	std::atomic<quint64> export_next_id;
+	std::atomic<int> export_pending;
+	std::atomic<int> export_png_compression;
+	std::atomic<int> export_jpeg_quality;
+	QThreadPool export_pool;
+
+	quint64 present_index;
+	//停止后保留最后一次录制，用于读取计数
+	std::shared_ptr<FrameRecorder> recorder;
+	bool recording;
+	//新一段录制在上一段写完后才开始写入，期间按队列容量缓存
+	QThreadPool record_pool;
+	//由ImageWidget提供选框快照
+	std::function<std::shared_ptr<const std::vector<ImageBoxData>>()> box_snapshot;
+	//派生类选框层栅格的字节数与释放，纳入像素预算
+	std::function<qint64()> box_raster_bytes;
+	std::function<void()> release_box_rasters;
+
+	//最新的帧在表头，serial从表头到表尾连续递减
+	std::deque<HistoryFrame> history;
+	qint64 history_budget;
+	int history_full_frames;
+	double history_scale;
+	bool history_compress;
+	qint64 history_bytes;
+	quint64 history_serial;
+	int history_degrading;
+	QThreadPool history_pool;
+	bool live_paused;
+	int history_offset;
+	//暂停时显示的帧，已恢复为原始尺寸；history_source为空表示该帧的原图已释放
+	QImage history_image;
+	PaintDataPtr history_data;
+	cv::Mat history_source;
+	quint64 history_source_serial;
+
+	qint64 pixel_budget;
+	//隐藏时为节省内存释放了display_img，记录原始尺寸，绘制前由原图重建
+	QSize display_full_size;
+	//隐藏且超出预算时不再显示新帧，邮箱中只保留最新一帧，绘制时恢复
+	std::atomic<bool> parked;
+	//导出与历史缩小任务提交时的快照，只在GUI线程中访问，任务结束后移除
+	std::map<quint64, cv::Mat> export_snapshots;
+	std::map<quint64, QImage> degrade_snapshots;
+	//后台任务生成、尚未交回的图像与编码数据
+	std::atomic<qint64> work_bytes;
+
+	std::mutex window_mutex;
+	double window_width;
+	double window_level;
+	bool auto_window;
+	double auto_window_low;
+	double auto_window_high;
+	std::shared_ptr<const std::vector<uchar>> window_lut;
+	double lut_window;
+	double lut_level;
+
+	std::mutex color_table_mutex;
+	QVector<QRgb> color_table;
+
+	double overlay_lod_threshold;
+	TextLayoutCache text_cache;
+
+	RetainedRaster frame_overlay;
+	struct OverlayLayer
+	{
+		PaintDataPtr data;
+		int z = 0;
+		bool visible = true;
+		RetainedRaster raster;
+	};
+	std::map<QString, OverlayLayer> overlay_layers;
+	OverlayStore overlay_store;
+public:
+	double getLogZoom()
+	{
+		return log_zoom;
+	}
+
+	QSize getImageSize()
+	{
+		return displayReduced() ? display_full_size : currentImage().size();
+	}
+
+	bool displayReduced()
+	{
+		return !display_full_size.isEmpty() && !done_flag && !live_paused;
+	}
+
+	void accountPixels(PixelLedger& ledger, ImageWidgetBase::PixelFootprint& out)
+	{
+		out.display += ledger.add(display_img);
+		out.done += ledger.add(display_img_done);
+		out.source += ledger.add(source_mat);
+		for (const auto& a : pyramid_levels)
+		{
+			out.caches += ledger.add(a);
+		}
+		//瓦片缓存的代价单位为KB
+		out.caches += qint64(tile_cache.totalCost()) * 1024;
+		for (const auto& a : { integral_tables, integral_spare })
+		{
+			if (a)
+			{
+				out.caches += ledger.add(a->sum);
+				out.caches += ledger.add(a->sq);
+			}
+		}
+		out.overlays += frame_overlay.bytes() + overlay_store.rasterBytes();
+		for (const auto& a : overlay_layers)
+		{
+			out.overlays += a.second.raster.bytes();
+		}
+		for (const auto& a : history)
+		{
+			out.history += ledger.add(a.image) + ledger.add(a.source) + a.encoded.size();
+		}
+		out.history += ledger.add(history_image) + ledger.add(history_source);
+		out.buffer_pool += buffer_pool.account(ledger) + snapshot_buffers.account(ledger);
+		if (recorder)
+		{
+			out.recording += recorder->pinned_bytes;
+		}
+		if (box_raster_bytes)
+		{
+			out.overlays += box_raster_bytes();
+		}
+		//已被历史淘汰或不再显示的快照才计入
+		for (const auto& a : export_snapshots)
+		{
+			out.in_flight += ledger.add(a.second);
+		}
+		for (const auto& a : degrade_snapshots)
+		{
+			out.in_flight += ledger.add(a.second);
+		}
+		out.in_flight += work_bytes;
+	}
+
+	ImageWidgetBase::PixelFootprint pixelFootprint()
+	{
+		PixelLedger ledger;
+		ImageWidgetBase::PixelFootprint out;
+		accountPixels(ledger, out);
+		return out;
+	}
+
+	static ImageWidgetBase::PixelFootprint globalPixelFootprint()
+	{
+		PixelLedger ledger;
+		ImageWidgetBase::PixelFootprint out;
+		for (auto w : PixelMemoryRegistry::instance().widgets)
+		{
+			w->accountPixels(ledger, out);
+		}
+		return out;
+	}
+
+	//按代价从小到大分级释放，level包含之前各级
+	void trimPixels(const int& level)
+	{
+		if (level >= 1)
+		{
+			//完成图计时已结束，不会再显示
+			if (!done_flag && !display_img_done.isNull())
+			{
+				display_img_done = QImage();
+			}
+			buffer_pool.releaseIdle();
+			snapshot_buffers.releaseIdle();
+			//积分图最先释放，需要时按帧在后台重建
+			integral_tables.reset();
+			integral_spare.reset();
+			{
+				std::lock_guard<std::mutex> lock(integral_mutex);
+				integral_request_serial = 0;
+				pending_integral_spare.reset();
+			}
+		}
+		if (level >= 2)
+		{
+			//同一帧不再重建金字塔，缩小显示时直接绘制原图
+			tile_cache.clear();
+			pyramid_levels.clear();
+			pyramid_source_key = 0;
+			frame_overlay.release();
+			for (auto& a : overlay_layers)
+			{
+				a.second.raster.release();
+			}
+			overlay_store.releaseRaster();
+			if (release_box_rasters)
+			{
+				release_box_rasters();
+			}
+			trimHistory();
+		}
+		if (level >= 3)
+		{
+			//录制队列限流，导出与历史缩小任务无法取消，完成后自行释放
+			if (recorder)
+			{
+				recorder->throttled = true;
+			}
+			if (!q_ptr->isVisible())
+			{
+				reduceDisplay();
+				//录制时仍需逐帧显示
+				if (!recording)
+				{
+					parked = true;
+				}
+			}
+		}
+	}
+
+	//隐藏的控件释放由原图转换出的显示图像，原图保留，绘制前由restoreDisplay重建；直接引用原图数据的显示图像不占额外内存，不释放
+	void reduceDisplay()
+	{
+		if (done_flag || live_paused || display_img.isNull() || !display_full_size.isEmpty())
+			return;
+		auto src = liveSourceMat();
+		if (src.empty() || (display_img.constBits() >= src.datastart && display_img.constBits() < src.dataend))
+			return;
+		display_full_size = display_img.size();
+		display_img = QImage();
+	}
+
+	void restoreDisplay()
+	{
+		if (display_full_size.isEmpty())
+			return;
+		display_full_size = QSize();
+		if (source_mat.empty())
+			return;
+		display_img = cvMatToQImage(source_mat);
+		source_image_key = display_img.cacheKey();
+	}
+
+	//绘制时调用：重建释放的显示图像，并显示隐藏期间邮箱中的最新一帧（转换在后台线程中进行）
+	void unpark()
+	{
+		restoreDisplay();
+		if (!parked)
+			return;
+		parked = false;
+		bool post(false), start_worker(false);
+		{
+			std::lock_guard<std::mutex> lock(ingest_mutex);
+			if (ingest_stopping)
+				return;
+			if (converted_frame.has_value() && !present_posted)
+			{
+				present_posted = true;
+				post = true;
+			}
+			if (pending_frame.has_value() && !ingest_running)
+			{
+				ingest_running = true;
+				start_worker = true;
+			}
+		}
+		if (post)
+		{
+			QMetaObject::invokeMethod(this, [this]() { presentConvertedFrame(); }, Qt::QueuedConnection);
+		}
+		if (start_worker)
+		{
+			ingest_pool.start(new ImageWidgetRunnable([this]() { ingestLoop(); }));
+		}
+	}
+
+	//先检查本控件的预算，再检查全局预算；全局超出时先裁减隐藏的控件
+	//全局合计只统计一次，之后只重算被裁减的控件并按差值更新
+	void enforcePixelBudget()
+	{
+		auto& registry = PixelMemoryRegistry::instance();
+		if (registry.enforcing)
+			return;
+		registry.enforcing = true;
+		bool over(false);
+		if (pixel_budget > 0)
+		{
+			auto total = pixelFootprint().total();
+			for (int level = 1; level <= 3 && total > pixel_budget; level++)
+			{
+				trimPixels(level);
+				total = pixelFootprint().total();
+			}
+			over = total > pixel_budget;
+		}
+		if (registry.budget > 0)
+		{
+			auto total = globalPixelFootprint().total();
+			if (total > registry.budget)
+			{
+				auto widgets = registry.widgets;
+				std::stable_partition(widgets.begin(), widgets.end(), [](ImageWidgetBasePrivate* w) { return !w->q_ptr->isVisible(); });
+				std::vector<qint64> sizes;
+				sizes.reserve(widgets.size());
+				for (auto w : widgets)
+				{
+					sizes.push_back(w->pixelFootprint().total());
+				}
+				for (int level = 1; level <= 3 && total > registry.budget; level++)
+				{
+					for (size_t i = 0; i < widgets.size() && total > registry.budget; i++)
+					{
+						widgets[i]->trimPixels(level);
+						auto after = widgets[i]->pixelFootprint().total();
+						total -= sizes[i] - after;
+						sizes[i] = after;
+					}
+				}
+			}
+			over = over || total > registry.budget;
+		}
+		//预算恢复后解除录制队列限流
+		if (!over && recorder)
+		{
+			recorder->throttled = false;
+		}
+		registry.enforcing = false;
+	}
+
+	QVector<QRgb> getColorTable()
+	{
+		std::lock_guard<std::mutex> lock(color_table_mutex);
+		return color_table;
+	}
+
+	//8位连续或按行存储的BGR/BGRA/灰度图直接引用Mat数据，不做颜色转换
+	//单通道图像设置了伪彩色表时以Indexed8显示，不展开为三通道
+	QImage wrapCVMat(const cv::Mat& m)
+	{
+		if (m.depth() != CV_8U || m.dims != 2)
+		{
+			return QImage();
+		}
+		switch (m.channels())
+		{
+		case 1:
+		{
+			auto table = getColorTable();
+			if (table.isEmpty())
+			{
+				return matToQImageView(m, QImage::Format::Format_Grayscale8);
+			}
+			auto img = matToQImageView(m, QImage::Format::Format_Indexed8);
+			img.setColorTable(table);
+			return img;
+		}
+		case 3:
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+			return matToQImageView(m, QImage::Format::Format_BGR888);
+#else
+			return QImage();
+#endif
+		case 4:
+#if Q_BYTE_ORDER == Q_LITTLE_ENDIAN
+			//与原先BGRA2RGB一致，忽略alpha通道
+			return matToQImageView(m, QImage::Format::Format_RGB32);
+#else
+			return QImage();
+#endif
+		default:
+			return QImage();
+		}
+	}
+
+	std::shared_ptr<const std::vector<uchar>> getWindowLUT(const double& window, const double& level)
+	{
+		std::lock_guard<std::mutex> lock(window_mutex);
+		if (window_lut && lut_window == window && lut_level == level)
+		{
+			return window_lut;
+		}
+		auto lut = std::make_shared<std::vector<uchar>>(65536);
+		auto low = level - window / 2.;
+		auto scale = 255. / window;
+		for (int i = 0; i < 65536; i++)
+		{
+			(*lut)[i] = cv::saturate_cast<uchar>((i - low) * scale);
+		}
+		window_lut = lut;
+		lut_window = window;
+		lut_level = level;
+		return window_lut;
+	}
+
+	//16位用查找表，其他深度用convertTo线性缩放，结果写入缓冲池
+	cv::Mat windowLevelTo8U(const cv::Mat& m)
+	{
+		double window, level, low_percent, high_percent;
+		bool is_auto;
+		{
+			std::lock_guard<std::mutex> lock(window_mutex);
+			window = window_width;
+			level = window_level;
+			is_auto = auto_window;
+			low_percent = auto_window_low;
+			high_percent = auto_window_high;
+		}
+		if (is_auto)
+		{
+			double low, high;
+			if (sampleWindowRange(m, low_percent, high_percent, low, high))
+			{
+				window = high - low;
+				level = (high + low) / 2.;
+				std::lock_guard<std::mutex> lock(window_mutex);
+				if (auto_window)
+				{
+					window_width = window;
+					window_level = level;
+				}
+			}
+		}
+		if (window <= 0.)
+		{
+			window = 1.;
+		}
+		auto dst = buffer_pool.acquire(m.rows, m.cols, CV_MAKETYPE(CV_8U, m.channels()));
+		if (m.depth() == CV_16U)
+		{
+			auto lut = getWindowLUT(window, level);
+			auto row_len = m.cols * m.channels();
+			cv::parallel_for_(cv::Range(0, m.rows), [&m, &dst, &lut, row_len](const cv::Range& range) {
+				const auto table = lut->data();
+				for (int y = range.start; y < range.end; y++)
+				{
+					auto src_row = m.ptr<ushort>(y);
+					auto dst_row = dst.ptr<uchar>(y);
+					for (int x = 0; x < row_len; x++)
+					{
+						dst_row[x] = table[src_row[x]];
+					}
+				}
+			});
+		}
+		else
+		{
+			auto alpha = 255. / window;
+			auto beta = -(level - window / 2.) * alpha;
+			m.convertTo(dst, CV_8U, alpha, beta);
+		}
+		return dst;
+	}
+
+	//线程安全，转换结果写入缓冲池中的空闲缓冲
+	QImage cvMatToQImage(const cv::Mat& m)
+	{
+		if (m.depth() != CV_8U)
+		{
+			if (m.channels() != 1 && m.channels() != 3 && m.channels() != 4)
+			{
+				return QImage();
+			}
+			return cvMatToQImage(windowLevelTo8U(m));
+		}
+		auto view = wrapCVMat(m);
+		if (!view.isNull())
+		{
+			return view;
+		}
+		int code;
+		switch (m.channels())
+		{
+		case 1:
+			code = cv::COLOR_GRAY2RGB;
+			break;
+		case 3:
+			code = cv::COLOR_BGR2RGB;
+			break;
+		case 4:
+			code = cv::COLOR_BGRA2RGB;
+			break;
+		default:
+			return QImage();
+		}
+		auto rgb = buffer_pool.acquire(m.rows, m.cols, CV_MAKETYPE(m.depth(), 3));
+		cv::cvtColor(m, rgb, code);
+		return matToQImageView(rgb, QImage::Format::Format_RGB888);
+	}
+
+	void fitSourceRect(const QSize& img_size)
+	{
+		QPoint src_pnt;
+		QSize src_size;
+		if (float(img_size.width()) / float(img_size.height()) > float(q_ptr->width()) / float(q_ptr->height()))
+		{
+			float power = float(img_size.width()) / float(q_ptr->width());
+			auto w = float(q_ptr->height()) * power;
+			src_pnt.setY(-(w - float(img_size.height())) / 2.);
+			src_pnt.setX(0);
+			src_size.setWidth(img_size.width());
+			src_size.setHeight(w);
+		}
+		else
+		{
+			float power = float(img_size.height()) / float(q_ptr->height());
+			auto h = float(q_ptr->width()) * power;
+			src_pnt.setY(0);
+			src_pnt.setX(-(h - float(img_size.width())) / 2.);
+			src_size.setWidth(h);
+			src_size.setHeight(img_size.height());
+		}
+		source_position = src_pnt;
+		source_size = src_size;
+	}
+
+	void submitFrame(const cv::Mat& m, PaintDataPtr data, const bool& has_data)
+	{
+		if (m.empty())
+		{
+			return;
+		}
+		frames_submitted++;
+		IngestFrame frame;
+		frame.mat = m;
+		frame.paint_data = std::move(data);
+		frame.has_data = has_data;
+		bool start_worker(false);
+		{
+			std::lock_guard<std::mutex> lock(ingest_mutex);
+			if (ingest_stopping)
+			{
+				return;
+			}
+			if (pending_frame.has_value())
+			{
+				frames_dropped++;
+			}
+			pending_frame = std::move(frame);
+			if (!ingest_running && !parked)
+			{
+				ingest_running = true;
+				start_worker = true;
+			}
+		}
+		if (start_worker)
+		{
+			ingest_pool.start(new ImageWidgetRunnable([this]() { ingestLoop(); }));
+		}
+	}
+
+	//后台线程：取出最新的待转换帧，转换后放入单槽邮箱
+	void ingestLoop()
+	{
+		while (true)
+		{
+			IngestFrame frame;
+			{
+				std::lock_guard<std::mutex> lock(ingest_mutex);
+				if (ingest_stopping || !pending_frame.has_value() || parked)
+				{
+					ingest_running = false;
+					return;
+				}
+				frame = std::move(pending_frame.value());
+				pending_frame.reset();
+			}
+			frame.image = cvMatToQImage(frame.mat);
+			if (frame.image.isNull())
+			{
+				frames_dropped++;
+				continue;
+			}
+			frames_converted++;
+			bool post(false);
+			{
+				std::lock_guard<std::mutex> lock(ingest_mutex);
+				if (converted_frame.has_value())
+				{
+					frames_dropped++;
+				}
+				converted_frame = std::move(frame);
+				if (!present_posted)
+				{
+					present_posted = true;
+					post = true;
+				}
+			}
+			if (post)
+			{
+				QMetaObject::invokeMethod(this, [this]() { presentConvertedFrame(); }, Qt::QueuedConnection);
+			}
+		}
+	}
+
+	void presentConvertedFrame()
+	{
+		std::optional<IngestFrame> frame;
+		{
+			std::lock_guard<std::mutex> lock(ingest_mutex);
+			present_posted = false;
+			//隐藏期间帧留在邮箱中，由unpark补发
+			if (parked)
+				return;
+			frame.swap(converted_frame);
+		}
+		if (!frame.has_value())
+		{
+			return;
+		}
+		if (frame->has_data)
+		{
+			paint_data = std::move(frame->paint_data);
+		}
+		if (display_img.size() != frame->image.size())
+		{
+			fitSourceRect(frame->image.size());
+		}
+		setSourceMat(frame->mat);
+		display_img = frame->image;
+		display_full_size = QSize();
+		source_image_key = display_img.cacheKey();
+		frames_presented++;
+		framePresented();
+		q_ptr->update();
+	}
+
+	//接收到的最新画面，暂停时也照常更新
+	const QImage& liveImage()
+	{
+		return done_flag ? display_img_done : display_img;
+	}
+
+	const PaintDataPtr& livePaintData()
+	{
+		return done_flag ? done_paint_data : paint_data;
+	}
+
+	//屏幕上显示的画面，暂停时为历史帧
+	const QImage& currentImage()
+	{
+		return live_paused ? history_image : liveImage();
+	}
+
+	const PaintDataPtr& currentPaintData()
+	{
+		return live_paused ? history_data : livePaintData();
+	}
+
+	static QImage pyramidSource(const QImage& img)
+	{
+		switch (img.format())
+		{
+		case QImage::Format_Grayscale8:
+		case QImage::Format_RGB888:
+#if QT_VERSION >= QT_VERSION_CHECK(5, 14, 0)
+		case QImage::Format_BGR888:
+#endif
+		case QImage::Format_RGB32:
+		case QImage::Format_ARGB32:
+		case QImage::Format_ARGB32_Premultiplied:
+		case QImage::Format_RGBX8888:
+		case QImage::Format_RGBA8888:
+		case QImage::Format_RGBA8888_Premultiplied:
+			return img;
+		default:
+			return img.convertToFormat(QImage::Format_ARGB32_Premultiplied);
+		}
+	}
+
+	//每层长宽减半，直到最长边不超过一个瓦片
+	static std::vector<QImage> buildPyramid(const QImage& img)
+	{
+		std::vector<QImage> levels;
+		const auto src_img = pyramidSource(img);
+		cv::Mat src(src_img.height(), src_img.width(), CV_8UC(src_img.depth() / 8), const_cast<uchar*>(src_img.constBits()), src_img.bytesPerLine());
+		while (std::max(src.cols, src.rows) > pyramid_tile_size)
+		{
+			cv::Mat dst;
+			cv::resize(src, dst, cv::Size((src.cols + 1) / 2, (src.rows + 1) / 2), 0, 0, cv::INTER_AREA);
+			levels.push_back(matToQImageView(dst, src_img.format()));
+			src = dst;
+		}
+		return levels;
+	}
+
+	void requestPyramid(const QImage& img)
+	{
+		bool start_worker(false);
+		{
+			std::lock_guard<std::mutex> lock(pyramid_mutex);
+			if (pyramid_stopping || pyramid_request_key == img.cacheKey())
+			{
+				return;
+			}
+			pyramid_request_key = img.cacheKey();
+			pending_pyramid = img;
+			if (!pyramid_running)
+			{
+				pyramid_running = true;
+				start_worker = true;
+			}
+		}
+		pyramid_levels.clear();
+		tile_cache.clear();
+		if (start_worker)
+		{
+			pyramid_pool.start(new ImageWidgetRunnable([this]() { pyramidLoop(); }));
+		}
+	}
+
+	void pyramidLoop()
+	{
+		while (true)
+		{
+			QImage img;
+			{
+				std::lock_guard<std::mutex> lock(pyramid_mutex);
+				if (pyramid_stopping || pending_pyramid.isNull())
+				{
+					pyramid_running = false;
+					return;
+				}
+				img = pending_pyramid;
+				pending_pyramid = QImage();
+			}
+			auto key = img.cacheKey();
+			auto levels = buildPyramid(img);
+			QMetaObject::invokeMethod(this, [this, key, levels]() { onPyramidReady(key, levels); }, Qt::QueuedConnection);
+		}
+	}
+
+	//显示参数变化后由当前原图重新生成显示图像，显示的是QImage来源时不处理
+	void rewrapSourceMat()
+	{
+		if (source_mat.empty() || display_img.cacheKey() != source_image_key)
+			return;
+		display_img = cvMatToQImage(source_mat);
+		source_image_key = display_img.cacheKey();
+	}
+
+	void setSourceMat(const cv::Mat& mat)
+	{
+		source_mat = mat;
+		source_serial++;
+		//暂停时积分图属于显示的历史帧，保持不变
+		if (live_paused)
+			return;
+		//没有其他引用时留作下一帧的缓冲
+		if (integral_tables && integral_tables.use_count() == 1)
+		{
+			integral_spare = std::move(integral_tables);
+		}
+		integral_tables.reset();
+	}
+
+	//显示图像由source_mat转换而来时原图有效，displayQImage与完成图没有对应的原图
+	//隐藏时释放了显示图像（display_full_size非空）的帧仍以source_mat为准，绘制前由其重建
+	cv::Mat liveSourceMat()
+	{
+		if (done_flag || (display_full_size.isEmpty() && display_img.cacheKey() != source_image_key))
+		{
+			return cv::Mat();
+		}
+		return source_mat;
+	}
+
+	//屏幕上显示的帧对应的原图，暂停时为历史帧保留的原图；已缩小的历史帧、displayQImage显示的图像与完成图为空
+	cv::Mat currentSourceMat()
+	{
+		return live_paused ? history_source : liveSourceMat();
+	}
+
+	//显示的帧没有原图时为0，不会与任何已构建的积分图匹配
+	quint64 currentSourceSerial()
+	{
+		if (live_paused)
+			return history_source.empty() ? 0 : history_source_serial;
+		return liveSourceMat().empty() ? 0 : source_serial;
+	}
+
+	//当前帧的积分图，未就绪时返回空并在后台构建，完成后发出integralReady
+	std::shared_ptr<const IntegralTables> currentIntegral()
+	{
+		auto serial = currentSourceSerial();
+		if (serial == 0)
+		{
+			return nullptr;
+		}
+		if (integral_tables && integral_source_serial == serial)
+		{
+			return integral_tables;
+		}
+		const auto& mat = currentSourceMat();
+		if (mat.empty())
+		{
+			return nullptr;
+		}
+		bool start_worker(false);
+		{
+			std::lock_guard<std::mutex> lock(integral_mutex);
+			if (integral_stopping || integral_request_serial == serial)
+			{
+				return nullptr;
+			}
+			integral_request_serial = serial;
+			pending_integral = mat;
+			if (integral_spare)
+			{
+				pending_integral_spare = std::move(integral_spare);
+			}
+			if (!integral_running)
+			{
+				integral_running = true;
+				start_worker = true;
+			}
+		}
+		if (start_worker)
+		{
+			integral_pool.start(new ImageWidgetRunnable([this]() { integralLoop(); }));
+		}
+		return nullptr;
+	}
+
+	void integralLoop()
+	{
+		while (true)
+		{
+			cv::Mat mat;
+			quint64 serial;
+			std::shared_ptr<IntegralTables> spare;
+			{
+				std::lock_guard<std::mutex> lock(integral_mutex);
+				if (integral_stopping || pending_integral.empty())
+				{
+					integral_running = false;
+					return;
+				}
+				mat = pending_integral;
+				serial = integral_request_serial;
+				pending_integral.release();
+				spare = std::move(pending_integral_spare);
+			}
+			auto tables = buildIntegral(mat, std::move(spare));
+			QMetaObject::invokeMethod(this, [this, serial, tables]() { onIntegralReady(serial, tables); }, Qt::QueuedConnection);
+		}
+	}
+
+	void onIntegralReady(const quint64& serial, const std::shared_ptr<IntegralTables>& tables)
+	{
+		if (serial != currentSourceSerial())
+		{
+			if (!integral_spare)
+			{
+				integral_spare = tables;
+			}
+			return;
+		}
+		integral_source_serial = serial;
+		integral_tables = tables;
+		emit integralReady();
+	}
+
+	//新帧显示后调用，录制只入队引用计数快照，不在显示线程中做转换和写入
+	void framePresented()
+	{
+		present_index++;
+		auto keep_history = history_budget > 0 && !liveImage().isNull();
+		//录制与历史共用同一份自有快照
+		QImage image;
+		cv::Mat source;
+		if (recording || keep_history)
+		{
+			snapshotLive(image, source, keep_history);
+		}
+		if (recording)
+		{
+			RecordFrame frame;
+			frame.image = image;
+			frame.data = livePaintData();
+			if (box_snapshot)
+			{
+				frame.boxes = box_snapshot();
+			}
+			frame.index = present_index;
+			frame.timestamp = QDateTime::currentMSecsSinceEpoch();
+			recorder->push(std::move(frame));
+		}
+		if (keep_history)
+		{
+			pushHistory(image, source);
+		}
+		enforcePixelBudget();
+	}
+
+	//最新一帧的自有快照：零拷贝显示时图像与原图都引用调用方的Mat，调用方复用缓冲原地写入新帧时
+	//保留的帧会随之改变，因此原图复制到snapshot_buffers的缓冲中，引用原图的显示图像改为引用该副本
+	//keep_source为false时（只录制）原图只在显示图像引用它时才复制
+	void snapshotLive(QImage& image, cv::Mat& source, const bool& keep_source = true)
+	{
+		image = liveImage();
+		source = liveSourceMat();
+		if (image.isNull())
+			return;
+		if (!source.empty())
+		{
+			auto bits = image.constBits();
+			auto aliased = bits >= source.datastart && bits < source.dataend;
+			if (!keep_source && !aliased)
+			{
+				source = cv::Mat();
+				return;
+			}
+			cv::Mat owned;
+			if (source.dims == 2)
+			{
+				owned = snapshot_buffers.acquire(source.rows, source.cols, source.type());
+				source.copyTo(owned);
+			}
+			else
+			{
+				owned = source.clone();
+			}
+			if (aliased && owned.dims == 2)
+			{
+				auto table = image.colorTable();
+				image = matToQImageView(owned, image.format());
+				image.setColorTable(table);
+			}
+			source = owned;
+		}
+		else if (done_flag)
+		{
+			//完成图可能是displayDoneCVMat对调用方Mat的零拷贝视图
+			image = image.copy();
+		}
+	}
+
+	void pushHistory(const QImage& image, const cv::Mat& source)
+	{
+		HistoryFrame entry;
+		entry.image = image;
+		entry.source = source;
+		entry.size = entry.image.size();
+		entry.data = livePaintData();
+		entry.source_serial = source_serial;
+		entry.serial = ++history_serial;
+		entry.bytes = entry.pixelBytes();
+		history_bytes += entry.bytes;
+		history.push_front(std::move(entry));
+		degradeHistory();
+		enforceHistoryBudget();
+		//暂停时画面不变，其在历史中的位置后移
+		if (live_paused)
+		{
+			history_offset = std::min(history_offset + 1, int(history.size()) - 1);
+			emit q_ptr->historyPositionChanged(history_offset, int(history.size()));
+		}
+	}
+
+	//超出full_frames的帧交给后台缩小或压缩并释放原图，同时进行的任务有上限，来不及处理的帧由预算淘汰
+	void degradeHistory()
+	{
+		degradeHistory(history_full_frames);
+	}
+
+	void degradeHistory(const int& full_frames)
+	{
+		if (history_scale >= 1. && !history_compress)
+			return;
+		for (size_t i = size_t(std::max(0, full_frames)); i < history.size() && history_degrading < 4; i++)
+		{
+			auto& entry = history[i];
+			if (entry.degraded)
+				continue;
+			entry.degraded = true;
+			releaseHistorySource(entry);
+			history_degrading++;
+			auto serial = entry.serial;
+			auto img = entry.image;
+			auto scale = history_scale;
+			auto compress = history_compress;
+			degrade_snapshots[serial] = img;
+			history_pool.start(new ImageWidgetRunnable([this, serial, img, scale, compress]() {
+				auto small = img;
+				if (scale < 1.)
+				{
+					small = img.scaled(std::max(1, int(img.width() * scale)), std::max(1, int(img.height() * scale)), Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+				}
+				QByteArray encoded;
+				if (compress)
+				{
+					QBuffer buf(&encoded);
+					buf.open(QIODevice::WriteOnly);
+					if (small.save(&buf, "JPG", 90))
+					{
+						small = QImage();
+					}
+					else
+					{
+						encoded.clear();
+					}
+				}
+				work_bytes += small.sizeInBytes() + encoded.size();
+				QMetaObject::invokeMethod(this, [this, serial, small, encoded]() { onHistoryDegraded(serial, small, encoded); }, Qt::QueuedConnection);
+			}));
+		}
+	}
+
+	void onHistoryDegraded(const quint64& serial, const QImage& img, const QByteArray& encoded)
+	{
+		history_degrading--;
+		degrade_snapshots.erase(serial);
+		work_bytes -= img.sizeInBytes() + encoded.size();
+		if (!history.empty() && serial <= history.front().serial && history.front().serial - serial < history.size())
+		{
+			auto& entry = history[size_t(history.front().serial - serial)];
+			history_bytes -= entry.bytes;
+			entry.image = img;
+			entry.encoded = encoded;
+			entry.bytes = entry.pixelBytes();
+			history_bytes += entry.bytes;
+		}
+		degradeHistory();
+		enforceHistoryBudget();
+	}
+
+	void releaseHistorySource(HistoryFrame& entry)
+	{
+		if (entry.source.empty())
+			return;
+		history_bytes -= entry.bytes;
+		entry.source.release();
+		entry.bytes = entry.pixelBytes();
+		history_bytes += entry.bytes;
+	}
+
+	//像素预算不足时：除最新一帧外释放原图并提前缩小，再按历史预算淘汰，不清空历史
+	void trimHistory()
+	{
+		for (size_t i = 1; i < history.size(); i++)
+		{
+			releaseHistorySource(history[i]);
+		}
+		degradeHistory(1);
+		enforceHistoryBudget();
+	}
+
+	//从最旧的帧开始淘汰，至少保留最新一帧
+	void enforceHistoryBudget()
+	{
+		while (history.size() > 1 && history_bytes > history_budget)
+		{
+			history_bytes -= history.back().bytes;
+			history.pop_back();
+		}
+		if (history_budget <= 0)
+		{
+			history.clear();
+			history_bytes = 0;
+		}
+		history_offset = std::max(0, std::min(history_offset, int(history.size()) - 1));
+	}
+
+	//解码并恢复原始尺寸后显示
+	void showHistory(const int& offset)
+	{
+		if (history.empty())
+			return;
+		history_offset = std::max(0, std::min(offset, int(history.size()) - 1));
+		const auto& entry = history[size_t(history_offset)];
+		auto img = entry.encoded.isEmpty() ? entry.image : QImage::fromData(entry.encoded, "JPG");
+		if (!img.isNull() && img.size() != entry.size)
+		{
+			img = img.scaled(entry.size, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+		}
+		history_image = img;
+		history_data = entry.data;
+		history_source = entry.source;
+		history_source_serial = entry.source_serial;
+		emit q_ptr->historyPositionChanged(history_offset, int(history.size()));
+		q_ptr->update();
+	}
+
+	//render在导出线程中生成要保存的图像，只能使用提交时快照的数据；snapshot为render持有的原图，计入像素占用
+	quint64 enqueueExport(const QString& file, std::function<cv::Mat()> render, const cv::Mat& snapshot = cv::Mat())
+	{
+		auto id = ++export_next_id;
+		std::vector<int> params = {
+			cv::IMWRITE_PNG_COMPRESSION, export_png_compression.load(),
+			cv::IMWRITE_JPEG_QUALITY, export_jpeg_quality.load()
+		};
+		export_pending++;
+		if (!snapshot.empty())
+		{
+			export_snapshots[id] = snapshot;
+		}
+		export_pool.start(new ImageWidgetRunnable([this, id, file, params, render, snapshot]() {
+			runExport(id, file, params, render, snapshot);
+		}));
+		return id;
+	}
+
+	//生成占0-25%，编码占25-50%，其余按写入字节数报告
+	void runExport(const quint64& id, const QString& file, const std::vector<int>& params, const std::function<cv::Mat()>& render, const cv::Mat& snapshot)
+	{
+		postExportProgress(id, 0);
+		bool ok(false);
+		qint64 held(0);
+		try
+		{
+			auto mat = render();
+			//与快照共享的结果已经计入
+			if (!mat.empty() && mat.datastart != snapshot.datastart)
+			{
+				held += qint64(mat.dataend - mat.datastart);
+				work_bytes += qint64(mat.dataend - mat.datastart);
+			}
+			postExportProgress(id, 25);
+			auto suffix = QFileInfo(file).suffix().toLower();
+			std::vector<uchar> buf;
+			if (!mat.empty() && !suffix.isEmpty() && cv::imencode(("." + suffix).toStdString(), mat, buf, params))
+			{
+				held += qint64(buf.size());
+				work_bytes += qint64(buf.size());
+				postExportProgress(id, 50);
+				ok = writeExport(id, file, buf);
+			}
+		}
+		//cv::Exception派生自std::exception，内存不足等异常同样按失败上报，不能逃出线程池
+		catch (const std::exception&)
+		{
+			ok = false;
+		}
+		work_bytes -= held;
+		export_pending--;
+		QMetaObject::invokeMethod(this, [this, id, file, ok]() {
+			export_snapshots.erase(id);
+			emit q_ptr->exportFinished(id, file, ok);
+		}, Qt::QueuedConnection);
+	}
+
+	bool writeExport(const quint64& id, const QString& file, const std::vector<uchar>& buf)
+	{
+		const qint64 chunk = 4 * 1024 * 1024;
+		QFile out(file);
+		if (!out.open(QIODevice::WriteOnly | QIODevice::Truncate))
+		{
+			return false;
+		}
+		auto total = qint64(buf.size());
+		int percent(50);
+		for (qint64 pos = 0; pos < total; pos += chunk)
+		{
+			auto n = std::min(chunk, total - pos);
+			if (out.write(reinterpret_cast<const char*>(buf.data()) + pos, n) != n)
+			{
+				out.close();
+				out.remove();
+				return false;
+			}
+			auto p = 50 + int(50 * (pos + n) / total);
+			if (p != percent && p < 100)
+			{
+				percent = p;
+				postExportProgress(id, p);
+			}
+		}
+		out.close();
+		postExportProgress(id, 100);
+		return true;
+	}
+
+	void postExportProgress(const quint64& id, const int& percent)
+	{
+		QMetaObject::invokeMethod(this, [this, id, percent]() { emit q_ptr->exportProgress(id, percent); }, Qt::QueuedConnection);
+	}
+
+	void onPyramidReady(const qint64& key, const std::vector<QImage>& levels)
+	{
+		if (currentImage().cacheKey() != key)
+		{
+			return;
+		}
+		pyramid_source_key = key;
+		pyramid_levels = levels;
+		tile_cache.clear();
+		q_ptr->update();
+	}
+
+	QImage pyramidTile(const int& level, const int& tx, const int& ty)
+	{
+		quint64 key = (quint64(level) << 48) | (quint64(ty) << 24) | quint64(tx);
+		if (auto cached = tile_cache.object(key))
+		{
+			return *cached;
+		}
+		const auto& level_img = pyramid_levels[level - 1];
+		auto rt = QRect(tx * pyramid_tile_size, ty * pyramid_tile_size, pyramid_tile_size, pyramid_tile_size).intersected(level_img.rect());
+		auto tile = level_img.copy(rt).convertToFormat(QImage::Format_ARGB32_Premultiplied);
+		tile_cache.insert(key, new QImage(tile), std::max(1, int(tile.sizeInBytes() / 1024)));
+		return tile;
+	}
+
+	//缩小显示大图时按getPower()选择金字塔层，只绘制可见瓦片
+	bool paintPyramid(QPainter* painter)
+	{
+		const auto& img = currentImage();
+		if (pyramid_threshold <= 0 || displayReduced() || qint64(img.width()) * qint64(img.height()) < pyramid_threshold)
+		{
+			return false;
+		}
+		auto power = getPower();
+		if (!(power > 0.))
+		{
+			return false;
+		}
+		int level = int(std::floor(std::log2(1. / power)));
+		if (level < 1)
+		{
+			return false;
+		}
+		if (pyramid_source_key != img.cacheKey())
+		{
+			requestPyramid(img);
+			return false;
+		}
+		level = std::min(level, int(pyramid_levels.size()));
+		if (level < 1)
+		{
+			return false;
+		}
+		const auto& level_img = pyramid_levels[level - 1];
+		double scale = double(1 << level);
+		auto visible = QRectF(source_position / scale, source_size / scale).intersected(QRectF(level_img.rect()));
+		if (visible.isEmpty())
+		{
+			return true;
+		}
+		int tx_begin = int(visible.left()) / pyramid_tile_size;
+		int ty_begin = int(visible.top()) / pyramid_tile_size;
+		int tx_end = (int(std::ceil(visible.right())) - 1) / pyramid_tile_size;
+		int ty_end = (int(std::ceil(visible.bottom())) - 1) / pyramid_tile_size;
+		painter->save();
+		QTransform transform;
+		transform.translate(-source_position.x() * power, -source_position.y() * power);
+		transform.scale(power * scale, power * scale);
+		painter->setTransform(transform, true);
+		for (int ty = ty_begin; ty <= ty_end; ty++)
+		{
+			for (int tx = tx_begin; tx <= tx_end; tx++)
+			{
+				painter->drawImage(QPointF(tx * pyramid_tile_size, ty * pyramid_tile_size), pyramidTile(level, tx, ty));
+			}
+		}
+		painter->restore();
+		return true;
+	}
+
+	void startDoneImageTimer(const int& ms = 2000)
+	{
+		done_timer.start(ms);
+		done_flag = true;
+	}
+
+	void doneImageTimerTimeout()
+	{
+		done_flag = false;
+		done_timer.stop();
+		done_paint_data.reset();
+		paint_data.reset();
+		q_ptr->update();
+	}
+	double getAveragePower()
+	{
+		return (getXPower() + getYPower()) / 2.;
+	}
+	void zoomIn(QWheelEvent* e)
+	{
+		auto m = e->posF();
+
+		float power;
+		if (source_size.width() > source_size.height())
+		{
+			power = float(source_size.width()) / float(q_ptr->width());
+		}
+		else
+		{
+			power = float(source_size.height()) / float(q_ptr->height());
+		}
+
+
+		m.setX(m.x() * power); m.setY(m.y() * power);
+		m *= 0.05;
+		source_position += m;
+		source_size *= 0.95;
+		q_ptr->update();
+	}
+	void zoomOut(QWheelEvent* e)
+	{
+		auto m = e->posF();
+
+		float power;
+		if (source_size.width() > source_size.height())
+		{
+			power = float(source_size.width()) / float(q_ptr->width());
+		}
+		else
+		{
+			power = float(source_size.height()) / float(q_ptr->height());
+		}
+
+		m.setX(m.x() * power); m.setY(m.y() * power);
+		m *= 0.05;
+
+		source_position -= m;
+		source_size /= 0.95;
+
+		q_ptr->update();
+	}
+
+	double getXPower()
+	{
+		return source_size.width() / q_ptr->width();
+	}
+
+	double getYPower()
+	{
+		return source_size.height() / q_ptr->height();
+	}
+
+	void getMovedBox(ImageBox& box, const QPoint& start_point, const QPoint& end_point)
+	{
+		QPointF vec = end_point - start_point;
+		vec.setX(vec.x() * (source_size.width() / q_ptr->width()));
+		vec.setY(vec.y() * (source_size.height() / q_ptr->height()));
+		box.moveBox(vec,getImageSize());
+	}
+
+	template <typename T, typename Y>
+	T getImageLine(const Y& rt)
+	{
+		auto p1 = getImagePosition<decltype(rt.p1())>(rt.p1());
+		auto p2 = getImagePosition<decltype(rt.p2())>(rt.p2());
+		T rtn;
+		rtn.setP1(p1);
+		rtn.setP2(p2);
+		return rtn;
+	}
+
+	template <typename T, typename Y>
+	T getPaintLine(const Y& rt)
+	{
+		auto p1 = getPaintPosition<decltype(rt.p1())>(rt.p1());
+		auto p2 = getPaintPosition<decltype(rt.p2())>(rt.p2());
+		T rtn;
+		rtn.setP1(p1);
+		rtn.setP2(p2);
+		return rtn;
+	}
+
+	template <typename T, typename Y>
+	T getImageRect(const Y& rt)
+	{
+		auto tl = getImagePosition<decltype(rt.topLeft())>(rt.topLeft());
+		auto br = getImagePosition<decltype(rt.bottomRight())>(rt.bottomRight());
+		T rtn;
+		rtn.setTopLeft(tl);
+		rtn.setBottomRight(br);
+		return rtn;
+	}
+
+	template <typename T, typename Y>
+	T getPaintRect(const Y& rt)
+	{
+		auto tl = getPaintPosition<decltype(rt.topLeft())>(rt.topLeft());
+		auto br = getPaintPosition<decltype(rt.bottomRight())>(rt.bottomRight());
+		T rtn;
+		rtn.setTopLeft(tl);
+		rtn.setBottomRight(br);
+		return rtn;
+	}
+
+	template<typename T, typename Y>
+	T getPaintPosition(const Y& rt)
+	{
+		auto tmp_img = &currentImage();
+		double power(1.);
+		if (tmp_img->width() > tmp_img->height())
+		{
+			power = double(q_ptr->width()) / double(source_size.width());
+		}
+		else
+		{
+			power = double(q_ptr->height()) / double(source_size.height());
+		}
+		return T((double(rt.x()) - double(source_position.x())) * power, (double(rt.y()) - double(source_position.y())) * power);
+	}
+	QSize getWidgetSize()
+	{
+		return QSize(int(q_ptr->width()), int(q_ptr->height()));
+	}
+
+	double getOverlayLodThreshold()
+	{
+		return overlay_lod_threshold;
+	}
+
+	//在绘制坐标的基线位置绘制文字，字体与排版走缓存
+	void drawCachedText(QPainter* painter, const QPointF& baseline, const QString& text, const int& family_id, const int& pixel_size)
+	{
+		text_cache.draw(painter, baseline, text, family_id, pixel_size);
+	}
+
+	int getTextCacheCapacity()
+	{
+		return text_cache.capacity();
+	}
+
+	OverlayViewport currentViewport(QPainter* painter)
+	{
+		OverlayViewport vp;
+		vp.source_position = source_position;
+		vp.source_size = source_size;
+		vp.widget_size = getWidgetSize();
+		vp.image_size = getImageSize();
+		vp.device_pixel_ratio = painter->device() ? painter->device()->devicePixelRatioF() : 1.;
+		vp.lod_threshold = overlay_lod_threshold;
+		return vp;
+	}
+
+	//帧数据叠加层，PaintData只读共享，指针不变即内容不变
+	void paintFrameOverlay(QPainter* painter)
+	{
+		const auto& data = currentPaintData();
+		if (!data)
+		{
+			frame_overlay.release();
+			return;
+		}
+		frame_overlay.paint(painter, currentViewport(painter), data, 0, [this, &data](QPainter* p) {
+			data->paintDatas(p, this);
+		});
+	}
+
+	//持久叠加层变化后投递一次刷新，只刷新变化区域
+	void postOverlayUpdate()
+	{
+		if (!overlay_store.takeUpdatePost())
+			return;
+		QMetaObject::invokeMethod(this, [this]() {
+			bool full(false);
+			auto region = overlay_store.takeUpdateRegion(getPaintTransform(), full);
+			if (full)
+			{
+				q_ptr->update();
+				return;
+			}
+#ifdef IMAGEWIDGET_QML
+			q_ptr->update(region.boundingRect());
+#else
+			q_ptr->update(region);
+#endif
+		}, Qt::QueuedConnection);
+	}
+
+	void paintOverlayStore(QPainter* painter)
+	{
+		overlay_store.paint(painter, currentViewport(painter), getPaintTransform(), [this](QPainter* p, const PaintData& data) {
+			data.paintDatas(p, this);
+		});
+	}
+
+	//below为true时绘制z小于0的层，否则绘制其余层
+	void paintOverlayLayers(QPainter* painter, const bool& below)
+	{
+		std::vector<OverlayLayer*> layers;
+		for (auto& a : overlay_layers)
+		{
+			auto& layer = a.second;
+			if (layer.visible && layer.data && (layer.z < 0) == below)
+			{
+				layers.push_back(&layer);
+			}
+		}
+		if (layers.empty())
+			return;
+		std::stable_sort(layers.begin(), layers.end(), [](const OverlayLayer* a, const OverlayLayer* b) { return a->z < b->z; });
+		auto vp = currentViewport(painter);
+		for (auto layer : layers)
+		{
+			const auto& data = layer->data;
+			layer->raster.paint(painter, vp, data, 0, [this, &data](QPainter* p) {
+				data->paintDatas(p, this);
+			});
+		}
+	}
+
+	//当前可见的图像区域（图像坐标）
+	QRectF getVisibleImageRect()
+	{
+		return QRectF(source_position, source_size);
+	}
+
+	//图像坐标到绘制坐标的变换，与getPaintPosition一致
+	QTransform getPaintTransform()
+	{
+		auto power = getPower();
+		QTransform transform;
+		transform.translate(-source_position.x() * power, -source_position.y() * power);
+		transform.scale(power, power);
+		return transform;
+	}
+
+	double getPower()
+	{
+		auto tmp_img = &currentImage();
+		double power(1.);
+		if (tmp_img->width() > tmp_img->height())
+		{
+			power = double(q_ptr->width()) / double(source_size.width());
+		}
+		else
+		{
+			power = double(q_ptr->height()) / double(source_size.height());
+		}
+		return power;
+	}
+
+	template <typename T, typename Y>
+	T getImagePosition(const Y& rt)
+	{
+		auto tmp_img = &currentImage();
+		double power(1.);
+		if (tmp_img->width() > tmp_img->height())
+		{
+			power = double(source_size.width()) / double(q_ptr->width());
+		}
+		else
+		{
+			power = double(source_size.height()) / double(q_ptr->height());
+		}
+		return T(double(rt.x()) * power + source_position.x(), double(rt.y()) * power + source_position.y());
+	}
+};
+
+ImageWidgetBase::ImageWidgetBase(
+#ifdef IMAGEWIDGET_QML
+	QQuickItem* parent)
+	: QQuickPaintedItem(parent),
+#else
+QWidget* parent)
+	: QWidget(parent),
+#endif // QIMAGEWIDGET_QML
+	d(new ImageWidgetBasePrivate(this))
+{
+#ifdef IMAGEWIDGET_QML
+	setAcceptedMouseButtons(Qt::LeftButton | Qt::RightButton);
+	connect(this, &ImageWidgetBase::widthChanged, this, &ImageWidgetBase::onWidthChanged);
+	connect(this, &ImageWidgetBase::heightChanged, this, &ImageWidgetBase::onHeightChanged);
+#endif // IMAGEWIDGET_QML
+	qRegisterMetaType<PaintDataPtr>("PaintDataPtr");
+}
+
+ImageWidgetBase::~ImageWidgetBase()
+{
+	delete d;
+}
+
+quint64 ImageWidgetBase::exportSourceImage(const QString& file)
+{
+	auto mat = d->currentSourceMat();
+	if (mat.empty())
+		return 0;
+	return d->enqueueExport(file, [mat]() { return mat; }, mat);
+}
+
+quint64 ImageWidgetBase::exportPaintedImage(const QString& file)
+{
+	auto mat = d->currentSourceMat();
+	if (mat.empty())
+		return 0;
+	//在屏幕上显示的8位图像上叠加，非8位原图同样按当前窗宽窗位与伪彩色映射；隐藏时显示图像已释放，在导出线程中由原图重新映射
+	auto img = d->currentImage();
+	auto data = d->currentPaintData();
+	auto dp = d;
+	return d->enqueueExport(file, [dp, mat, img, data]() {
+		auto tmp = qImageToBgrMat(img.isNull() ? dp->cvMatToQImage(mat) : img);
+		if (data && !tmp.empty())
+		{
+			data->drawDatas(tmp);
+		}
+		return tmp;
+	}, mat);
+}
+
+void ImageWidgetBase::setExportPngCompression(const int& level)
+{
+	d->export_png_compression = std::max(0, std::min(9, level));
+}
+
+void ImageWidgetBase::setExportJpegQuality(const int& quality)
+{
+	d->export_jpeg_quality = std::max(0, std::min(100, quality));
+}
+
+int ImageWidgetBase::getPendingExportCount()
+{
+	return d->export_pending;
+}
+
+void ImageWidgetBase::setFrameHistory(const qint64& budget_bytes, const int& full_frames, const double& old_scale, const bool& compress_old)
+{
+	d->history_budget = std::max(qint64(0), budget_bytes);
+	d->history_full_frames = std::max(0, full_frames);
+	d->history_scale = std::max(0.01, std::min(1., old_scale));
+	d->history_compress = compress_old;
+	d->snapshot_buffers.setDepth(d->history_full_frames + 2);
+	d->degradeHistory();
+	d->enforceHistoryBudget();
+}
+
+int ImageWidgetBase::getFrameHistorySize()
+{
+	return int(d->history.size());
+}
+
+qint64 ImageWidgetBase::getFrameHistoryBytes()
+{
+	return d->history_bytes;
+}
+
+void ImageWidgetBase::setLivePaused(const bool& pause)
+{
+	if (pause == d->live_paused)
+		return;
+	if (pause)
+	{
+		d->history_image = d->liveImage();
+		d->history_data = d->livePaintData();
+		d->history_source = d->liveSourceMat();
+		d->history_source_serial = d->source_serial;
+		d->history_offset = 0;
+		d->live_paused = true;
+		emit historyPositionChanged(0, int(d->history.size()));
+	}
+	else
+	{
+		d->live_paused = false;
+		d->history_image = QImage();
+		d->history_data.reset();
+		d->history_source.release();
+		d->history_offset = 0;
+	}
+	update();
+}
+
+bool ImageWidgetBase::isLivePaused()
+{
+	return d->live_paused;
+}
+
+bool ImageWidgetBase::hasCurrentSourceImage()
+{
+	return !d->currentSourceMat().empty();
+}
+
+void ImageWidgetBase::showHistoryFrame(const int& offset)
+{
+	setLivePaused(true);
+	d->showHistory(offset);
+}
+
+void ImageWidgetBase::stepHistory(const int& delta)
+{
+	showHistoryFrame(d->history_offset + delta);
+}
+
+int ImageWidgetBase::getHistoryOffset()
+{
+	return d->live_paused ? d->history_offset : 0;
+}
+
+ImageWidgetBase::PixelFootprint ImageWidgetBase::getPixelFootprint()
+{
+	return d->pixelFootprint();
+}
+
+ImageWidgetBase::PixelFootprint ImageWidgetBase::getGlobalPixelFootprint()
+{
+	return ImageWidgetBasePrivate::globalPixelFootprint();
+}
+
+void ImageWidgetBase::setPixelBudget(const qint64& bytes)
+{
+	d->pixel_budget = std::max(qint64(0), bytes);
+	d->enforcePixelBudget();
+}
+
+qint64 ImageWidgetBase::getPixelBudget()
+{
+	return d->pixel_budget;
+}
+
+void ImageWidgetBase::setGlobalPixelBudget(const qint64& bytes)
+{
+	PixelMemoryRegistry::instance().budget = std::max(qint64(0), bytes);
+}
+
+qint64 ImageWidgetBase::getGlobalPixelBudget()
+{
+	return PixelMemoryRegistry::instance().budget;
+}
+
+void ImageWidgetBase::enforcePixelBudget()
+{
+	d->enforcePixelBudget();
+}
+
+bool ImageWidgetBase::startRecording(const QString& dir, const QString& format, const int& queue_capacity, const double& fps, const int& segment_seconds, const int& keep_seconds, const qint64& queue_bytes)
+{
+	if (!FrameRecorder::isSupportedFormat(format) || !QDir().mkpath(dir))
+	{
+		return false;
+	}
+	stopRecording();
+	auto recorder = std::make_shared<FrameRecorder>(dir, format, queue_capacity, queue_bytes, fps, segment_seconds, keep_seconds);
+	d->recorder = recorder;
+	d->recording = true;
+	//录制需要逐帧显示，隐藏时暂停显示的帧恢复接收
+	d->unpark();
+	d->record_pool.start(new ImageWidgetRunnable([recorder]() { recorder->run(); }));
+	return true;
+}
+
+void ImageWidgetBase::stopRecording()
+{
+	if (d->recording)
+	{
+		d->recorder->stop();
+		d->recording = false;
+	}
+}
+
+bool ImageWidgetBase::isRecording()
+{
+	return d->recording;
+}
+
+ImageWidgetBase::RecordingCounters ImageWidgetBase::getRecordingCounters()
+{
+	RecordingCounters out;
+	if (d->recorder)
+	{
+		out.queued = d->recorder->queued;
+		out.written = d->recorder->written;
+		out.dropped = d->recorder->dropped;
+		out.queued_bytes = d->recorder->pinned_bytes;
+	}
+	return out;
+}
+
+std::vector<ImageWidgetBase::RecordedOverlay> ImageWidgetBase::readRecordingSidecar(const QString& file)
+{
+	std::vector<RecordedOverlay> out;
+	QFile in(file);
+	if (!in.open(QIODevice::ReadOnly))
+	{
+		return out;
+	}
+	QDataStream s(&in);
+	s.setVersion(QDataStream::Qt_5_6);
+	quint32 magic(0), version(0);
+	s >> magic >> version;
+	if (magic != record_magic || version != record_version)
+	{
+		return out;
+	}
+	while (!s.atEnd())
+	{
+		RecordedOverlay a;
+		qint32 frame(0);
+		s >> a.index >> a.timestamp >> frame;
+		a.frame = frame;
+		readRecordPaintData(s, a.data);
+		quint8 unchanged(0);
+		s >> unchanged;
+		if (unchanged && !out.empty())
+		{
+			a.boxes = out.back().boxes;
+		}
+		else if (!unchanged)
+		{
+			readRecordBoxes(s, a.boxes);
+		}
+		if (s.status() != QDataStream::Ok)
+		{
+			break;
+		}
+		out.push_back(std::move(a));
+	}
+	return out;
+}
+#include <fstream>
+void ImageWidgetBase::displayCVMat(cv::Mat img)
+{
+	if (img.empty())
+	{
+		return;
+	}
+
+	if (d->display_img.size() != QSize(img.cols, img.rows))
+	{
+		QPoint src_pnt;
+		QSize src_size;
+		if (float(img.cols) / float(img.rows) > float(width()) / float(height()))
+		{
+			float power = float(img.cols) / float(width());
+			auto w = float(height()) * power;
+			src_pnt.setY(-(w - float(img.rows)) / 2.);
+			src_pnt.setX(0);
+			src_size.setWidth(img.cols);
+			src_size.setHeight(w);
+		}
+		else
+		{
+
+			float power = float(img.rows) / float(height());
+			auto h = float(width()) * power;
+			src_pnt.setY(0);
+			src_pnt.setX(-(h - float(img.cols)) / 2.);
+			src_size.setWidth(h);
+			src_size.setHeight(img.rows);
+		}
+		d->source_position = src_pnt;
+		d->source_size = src_size;
+	}
+	d->setSourceMat(img);
+	d->display_img = d->cvMatToQImage(img);
+	d->display_full_size = QSize();
+	d->source_image_key = d->display_img.cacheKey();
+	d->framePresented();
+	update();
+}
+
+void ImageWidgetBase::submitCVMat(const cv::Mat& img)
+{
+	d->submitFrame(img, PaintDataPtr(), false);
+}
+
+void ImageWidgetBase::submitCVMatWithData(const cv::Mat& img, const PaintData& data)
+{
+	d->submitFrame(img, std::make_shared<const PaintData>(data), true);
+}
+
+void ImageWidgetBase::submitCVMatWithData(const cv::Mat& img, PaintData&& data)
+{
+	d->submitFrame(img, std::make_shared<const PaintData>(std::move(data)), true);
+}
+
+void ImageWidgetBase::submitCVMatWithData(const cv::Mat& img, PaintDataPtr data)
+{
+	d->submitFrame(img, std::move(data), true);
+}
+
+ImageWidgetBase::FrameCounters ImageWidgetBase::getFrameCounters()
+{
+	FrameCounters counters;
+	counters.submitted = d->frames_submitted;
+	counters.converted = d->frames_converted;
+	counters.dropped = d->frames_dropped;
+	counters.presented = d->frames_presented;
+	return counters;
+}
+
+void ImageWidgetBase::resetFrameCounters()
+{
+	d->frames_submitted = 0;
+	d->frames_converted = 0;
+	d->frames_dropped = 0;
+	d->frames_presented = 0;
+}
+
+ImageWidgetBase::BufferPoolCounters ImageWidgetBase::getBufferPoolCounters()
+{
+	return d->buffer_pool.getCounters();
+}
+
+void ImageWidgetBase::resetBufferPoolCounters()
+{
+	d->buffer_pool.resetCounters();
+}
+
+void ImageWidgetBase::setBufferPoolDepth(const int& depth)
+{
+	d->buffer_pool.setDepth(depth);
+}
+
+void ImageWidgetBase::setWindowLevel(const double& window, const double& level)
+{
+	{
+		std::lock_guard<std::mutex> lock(d->window_mutex);
+		d->auto_window = false;
+		d->window_width = window;
+		d->window_level = level;
+	}
+	//当前显示的非8位Mat按新窗宽窗位重新映射
+	if (!d->source_mat.empty() && d->source_mat.depth() != CV_8U)
+	{
+		d->rewrapSourceMat();
+	}
+	update();
+}
+
+void ImageWidgetBase::setAutoWindow(const bool& enable, const double& low_percent, const double& high_percent)
+{
+	{
+		std::lock_guard<std::mutex> lock(d->window_mutex);
+		d->auto_window = enable;
+		d->auto_window_low = low_percent;
+		d->auto_window_high = high_percent;
+	}
+	if (!d->source_mat.empty() && d->source_mat.depth() != CV_8U)
+	{
+		d->rewrapSourceMat();
+	}
+	update();
+}
+
+double ImageWidgetBase::getWindow()
+{
+	std::lock_guard<std::mutex> lock(d->window_mutex);
+	return d->window_width;
+}
+
+double ImageWidgetBase::getLevel()
+{
+	std::lock_guard<std::mutex> lock(d->window_mutex);
+	return d->window_level;
+}
+
+void ImageWidgetBase::setColorMap(const int& colormap)
+{
+	QVector<QRgb> table;
+	if (colormap >= 0)
+	{
+		cv::Mat ramp(1, 256, CV_8UC1);
+		for (int i = 0; i < 256; i++)
+		{
+			ramp.at<uchar>(0, i) = uchar(i);
+		}
+		cv::Mat bgr;
+		cv::applyColorMap(ramp, bgr, colormap);
+		table.reserve(256);
+		for (int i = 0; i < 256; i++)
+		{
+			auto c = bgr.at<cv::Vec3b>(0, i);
+			table.push_back(qRgb(c[2], c[1], c[0]));
+		}
+	}
+	setColorTable(table);
+}
+
+void ImageWidgetBase::setColorTable(const QVector<QRgb>& table)
+{
+	if (!table.isEmpty() && table.size() != 256)
+	{
+		return;
+	}
+	{
+		std::lock_guard<std::mutex> lock(d->color_table_mutex);
+		d->color_table = table;
+	}
+	//当前显示的单通道Mat按新颜色表重新包装
+	if (!d->source_mat.empty() && d->source_mat.channels() == 1)
+	{
+		d->rewrapSourceMat();
+	}
+	update();
+}
+
+void ImageWidgetBase::setOverlayLodThreshold(const double& pixels)
+{
+	d->overlay_lod_threshold = pixels;
+	update();
+}
+
+void ImageWidgetBase::setPyramidThreshold(const qint64& pixels)
+{
+	d->pyramid_threshold = pixels;
+	update();
+}
+
+void ImageWidgetBase::displayQImage(const QImage& img)
+{
+	if (img.byteCount() == 0)
+	{
+		return;
+	}
+	if (d->display_img.size() != img.size())
+	{
+		QPoint src_pnt;
+		QSize src_size;
+		if (float(img.width()) / float(img.height()) > float(width()) / float(height()))
+		{
+			float power = float(img.width()) / float(width());
+			auto w = float(height()) * power;
+			src_pnt.setY(-(w - float(img.height())) / 2.);
+			src_pnt.setX(0);
+			src_size.setWidth(img.width());
+			src_size.setHeight(w);
+		}
+		else
+		{
+			float power = float(img.height()) / float(height());
+			auto h = float(width()) * power;
+			src_pnt.setY(0);
+			src_pnt.setX(-(h - float(img.width())) / 2.);
+			src_size.setWidth(h);
+			src_size.setHeight(img.height());
+
+		}
+		d->source_position = src_pnt;
+		d->source_size = src_size;
+	}
+
+	d->display_img = img.copy();
+	d->display_full_size = QSize();
+	d->framePresented();
+	update();
+}
+
+void ImageWidgetBase::displayCVMatWithData(const cv::Mat& img, const PaintData& data)
+{
+	displayCVMatWithData(img, std::make_shared<const PaintData>(data));
+}
+
+void ImageWidgetBase::displayQImageWithData(const QImage& img, const PaintData& data)
+{
+	displayQImageWithData(img, std::make_shared<const PaintData>(data));
+}
+
+void ImageWidgetBase::displayCVMatWithData(const cv::Mat& img, PaintData&& data)
+{
+	displayCVMatWithData(img, std::make_shared<const PaintData>(std::move(data)));
+}
+
+void ImageWidgetBase::displayQImageWithData(const QImage& img, PaintData&& data)
+{
+	displayQImageWithData(img, std::make_shared<const PaintData>(std::move(data)));
+}
+
+void ImageWidgetBase::displayCVMatWithData(const cv::Mat& img, PaintDataPtr data)
+{
+	d->paint_data = std::move(data);
+	displayCVMat(img);
+}
+
+void ImageWidgetBase::displayQImageWithData(const QImage& img, PaintDataPtr data)
+{
+	d->paint_data = std::move(data);
+	displayQImage(img);
+}
+
+void ImageWidgetBase::displayDoneCVMat(const cv::Mat& img)
+{
+	if (img.empty())
+	{
+		return;
+	}
+	if (d->display_img_done.size() != QSize(img.cols, img.rows))
+	{
+		QPoint src_pnt;
+		QSize src_size;
+		if (float(img.cols) / float(img.rows) > float(width()) / float(height()))
+		{
+			float power = float(img.cols) / float(width());
+			auto w = float(height()) * power;
+			src_pnt.setY(-(w - float(img.rows)) / 2.);
+			src_pnt.setX(0);
+			src_size.setWidth(img.cols);
+			src_size.setHeight(w);
+		}
+		else
+		{
+			float power = float(img.rows) / float(height());
+			auto h = float(width()) * power;
+			src_pnt.setY(0);
+			src_pnt.setX(-(h - float(img.cols)) / 2.);
+			src_size.setWidth(h);
+			src_size.setHeight(img.rows);
+
+		}
+		d->source_position = src_pnt;
+		d->source_size = src_size;
+	}
+	d->display_img_done = d->cvMatToQImage(img);
+	d->startDoneImageTimer();
+	d->framePresented();
+	update();
+}
+
+void ImageWidgetBase::displayDoneQImage(const QImage& img)
+{
+	if (img.byteCount() == 0)
+	{
+		return;
+	}
+	if (d->display_img_done.size() != img.size())
+	{
+		QPoint src_pnt;
+		QSize src_size;
+		if (img.width() > img.height())
+		{
+			float power = float(img.width()) / float(width());
+			auto w = float(height()) * power;
+			src_pnt.setY(-(w - float(img.height())) / 2.);
+			src_pnt.setX(0);
+			src_size.setWidth(img.width());
+			src_size.setHeight(w);
+		}
+		else
+		{
+			float power = float(img.height()) / float(height());
+			auto h = float(width()) * power;
+			src_pnt.setY(0);
+			src_pnt.setX(-(h - float(img.width())) / 2.);
+			src_size.setWidth(h);
+			src_size.setHeight(img.height());
+
+		}
+		d->source_position = src_pnt;
+		d->source_size = src_size;
+	}
+	d->display_img_done = img.copy();
+	d->startDoneImageTimer();
+	d->framePresented();
+	update();
+}
+
+void ImageWidgetBase::displayDoneCVMatWithData(const cv::Mat& img, const PaintData& data)
+{
+	displayDoneCVMatWithData(img, std::make_shared<const PaintData>(data));
+}
+
+void ImageWidgetBase::displayDoneQImageWithData(const QImage& img, const PaintData& data)
+{
+	displayDoneQImageWithData(img, std::make_shared<const PaintData>(data));
+}
+
+void ImageWidgetBase::displayDoneCVMatWithData(const cv::Mat& img, PaintData&& data)
+{
+	displayDoneCVMatWithData(img, std::make_shared<const PaintData>(std::move(data)));
+}
+
+void ImageWidgetBase::displayDoneQImageWithData(const QImage& img, PaintData&& data)
+{
+	displayDoneQImageWithData(img, std::make_shared<const PaintData>(std::move(data)));
+}
+
+void ImageWidgetBase::displayDoneCVMatWithData(const cv::Mat& img, PaintDataPtr data)
+{
+	d->done_paint_data = std::move(data);
+	displayCVMat(img);
+}
+
+void ImageWidgetBase::displayDoneQImageWithData(const QImage& img, PaintDataPtr data)
+{
+	d->done_paint_data = std::move(data);
+	displayDoneQImage(img);
+}
+
+void ImageWidgetBase::setOverlayLayer(const QString& name, const PaintData& data, const int& z)
+{
+	setOverlayLayer(name, std::make_shared<const PaintData>(data), z);
+}
+
+void ImageWidgetBase::setOverlayLayer(const QString& name, PaintData&& data, const int& z)
+{
+	setOverlayLayer(name, std::make_shared<const PaintData>(std::move(data)), z);
+}
+
+void ImageWidgetBase::setOverlayLayer(const QString& name, PaintDataPtr data, const int& z)
+{
+	auto& layer = d->overlay_layers[name];
+	layer.data = std::move(data);
+	layer.z = z;
+	update();
+}
+
+void ImageWidgetBase::removeOverlayLayer(const QString& name)
+{
+	if (d->overlay_layers.erase(name))
+	{
+		update();
+	}
+}
+
+void ImageWidgetBase::setOverlayLayerVisible(const QString& name, const bool& visible)
+{
+	auto iter = d->overlay_layers.find(name);
+	if (iter == d->overlay_layers.end() || iter->second.visible == visible)
+		return;
+	iter->second.visible = visible;
+	if (!visible)
+	{
+		iter->second.raster.release();
+	}
+	update();
+}
+
+void ImageWidgetBase::clearOverlayLayers()
+{
+	d->overlay_layers.clear();
+	update();
+}
+
+QStringList ImageWidgetBase::getOverlayLayers()
+{
+	QStringList names;
+	for (const auto& a : d->overlay_layers)
+	{
+		names.append(a.first);
+	}
+	return names;
+}
+
+std::vector<ImageWidgetBase::OverlayHandle> ImageWidgetBase::appendOverlayItems(const PaintData& items)
+{
+	auto handles = d->overlay_store.append(items);
+	d->postOverlayUpdate();
+	return handles;
+}
+
+void ImageWidgetBase::updateOverlayItems(const std::vector<OverlayHandle>& handles, const PaintData& items)
+{
+	d->overlay_store.update(handles, items);
+	d->postOverlayUpdate();
+}
+
+void ImageWidgetBase::removeOverlayItems(const std::vector<OverlayHandle>& handles)
+{
+	d->overlay_store.remove(handles);
+	d->postOverlayUpdate();
+}
+
+void ImageWidgetBase::clearOverlayItems()
+{
+	d->overlay_store.clear();
+	d->postOverlayUpdate();
+}
+
+size_t ImageWidgetBase::getOverlayItemCount()
+{
+	return d->overlay_store.count();
+}
+
+void ImageWidgetBase::displayCVMat(QVariant img)
+{
+	if (img.canConvert<cv::Mat>())
+	{
+		displayCVMat(img.value<cv::Mat>());
+	}
+}
+
+void ImageWidgetBase::displayQImage(const QVariant& img)
+{
+	if (img.canConvert<QImage>())
+	{
+		displayQImage(img.value<QImage>());
+	}
+}
+
+void ImageWidgetBase::displayCVMatWithData(const QVariant& img, const QVariant& paint_data)
+{
+	if (!img.canConvert<cv::Mat>())
+	{
+		return;
+	}
+	if (paint_data.canConvert<PaintDataPtr>())
+	{
+		displayCVMatWithData(img.value<cv::Mat>(), paint_data.value<PaintDataPtr>());
+	}
+	else if (paint_data.canConvert<PaintData>())
+	{
+		displayCVMatWithData(img.value<cv::Mat>(), paint_data.value<PaintData>());
+	}
+}
+
+void ImageWidgetBase::displayQImageWithData(const QVariant& img, const QVariant& paint_data)
+{
+	if (!img.canConvert<QImage>())
+	{
+		return;
+	}
+	if (paint_data.canConvert<PaintDataPtr>())
+	{
+		displayQImageWithData(img.value<QImage>(), paint_data.value<PaintDataPtr>());
+	}
+	else if (paint_data.canConvert<PaintData>())
+	{
+		displayQImageWithData(img.value<QImage>(), paint_data.value<PaintData>());
+	}
+}
+
+void ImageWidgetBase::displayDoneCVMat(const QVariant& img)
+{
+	if (img.canConvert<cv::Mat>())
+	{
+		displayDoneCVMat(img.value<cv::Mat>());
+	}
+}
+
+void ImageWidgetBase::displayDoneQImage(const QVariant& img)
+{
+	if (img.canConvert<QImage>())
+	{
+		displayDoneQImage(img.value<QImage>());
+	}
+}
+
+void ImageWidgetBase::displayDoneCVMatWithData(const QVariant& img, const QVariant& paint_data)
+{
+	if (!img.canConvert<cv::Mat>())
+	{
+		return;
+	}
+	if (paint_data.canConvert<PaintDataPtr>())
+	{
+		displayDoneCVMatWithData(img.value<cv::Mat>(), paint_data.value<PaintDataPtr>());
+	}
+	else if (paint_data.canConvert<PaintData>())
+	{
+		displayDoneCVMatWithData(img.value<cv::Mat>(), paint_data.value<PaintData>());
+	}
+}
+
+void ImageWidgetBase::displayDoneQImageWithData(const QVariant& img, const QVariant& paint_data)
+{
+	if (!img.canConvert<QImage>())
+	{
+		return;
+	}
+	if (paint_data.canConvert<PaintDataPtr>())
+	{
+		displayDoneQImageWithData(img.value<QImage>(), paint_data.value<PaintDataPtr>());
+	}
+	else if (paint_data.canConvert<PaintData>())
+	{
+		displayDoneQImageWithData(img.value<QImage>(), paint_data.value<PaintData>());
+	}
+}
+
+void ImageWidgetBase::resetScale()
+{
+	QPoint src_pnt;
+	QSize src_size;
+
+	//显示图像被缩小时按原始尺寸计算
+	auto image_size = d->getImageSize();
+	if (!image_size.isEmpty())
+	{
+		if (float(image_size.width()) / float(image_size.height()) > float(width()) / float(height()))
+		{
+			float power = float(image_size.width()) / float(width());
+			auto w = float(height()) * power;
+			src_pnt.setY(-(w - float(image_size.height())) / 2.);
+			src_pnt.setX(0);
+			src_size.setWidth(image_size.width());
+			src_size.setHeight(w);
+		}
+		else
+		{
+			float power = float(image_size.height()) / float(height());
+			auto h = float(width()) * power;
+			src_pnt.setY(0);
+			src_pnt.setX(-(h - float(image_size.width())) / 2.);
+			src_size.setWidth(h);
+			src_size.setHeight(image_size.height());
+		}
+	}
+	d->source_position = src_pnt;
+	d->source_size = src_size;
+	update();
+
+}
+
+void ImageWidgetBase::setBackgroudColor(const QColor& c)
+{
+	d->backgroudcolor = c;
+	update();
+}
+
+void ImageWidgetBase::mousePressEvent(QMouseEvent* e)
+{
+	d->moving = true;
+	d->start_point = e->pos();
+	update();
+}
+
+void ImageWidgetBase::mouseMoveEvent(QMouseEvent* e)
+{
+	if (!d->moving)
+		return;
+	auto m = QPointF(e->pos().x(),e->pos().y());
+	auto vec = m - d->start_point;
+	vec.setX(vec.x() * (d->source_size.width() / width()));
+	vec.setY(vec.y() * (d->source_size.height() / height()));
+	d->source_position.setX(d->source_position.x() - vec.x());
+	d->source_position.setY(d->source_position.y() - vec.y());
+	d->start_point = m;
+	update();
+}
+
+void ImageWidgetBase::mouseReleaseEvent(QMouseEvent* e)
+{
+	d->moving = false;
+	emit clickedPosition(d->getImagePosition<QPoint>(e->pos()));
+}
+
+void ImageWidgetBase::mouseDoubleClickEvent(QMouseEvent* e)
+{
+	resetScale();
+}
+#ifdef IMAGEWIDGET_QML
+void ImageWidgetBase::onWidthChanged()
+{
+	resetScale();
+}
+
+void ImageWidgetBase::onHeightChanged()
+{
+	resetScale();
+}
+#endif
+#ifndef IMAGEWIDGET_QML
+void ImageWidgetBase::resizeEvent(QResizeEvent* e)
+{
+	QWidget::resizeEvent(e);
+	resetScale();
+}
+#endif
+
+#ifdef IMAGEWIDGET_QML
+void ImageWidgetBase::paint(QPainter* painter)
+#else
+void ImageWidgetBase::paintEvent(QPaintEvent* e)
+#endif
+{
+#ifdef IMAGEWIDGET_QML
+	QPainter* painter_ptr = painter;
+#else
+	QPainter painter_obj;
+	QPainter* painter_ptr = &painter_obj;
+	painter_ptr->begin(this);
+#endif
+	d->unpark();
+	painter_ptr->setBrush(QBrush(d->backgroudcolor));
+	painter_ptr->setPen(QPen(d->backgroudcolor));
+	painter_ptr->drawRect(QRect(0, 0, width(), height()));
+	if (!d->paintPyramid(painter_ptr))
+	{
+		painter_ptr->drawImage(QRectF(0, 0, width(), height()), d->currentImage(), QRectF(d->source_position, d->source_size));
+	}
+	d->paintOverlayLayers(painter_ptr, true);
+	d->paintFrameOverlay(painter_ptr);
+	d->paintOverlayLayers(painter_ptr, false);
+	d->paintOverlayStore(painter_ptr);
+#ifndef IMAGEWIDGET_QML
+	painter_ptr->end();
+#endif
+}
+
+void ImageWidgetBase::wheelEvent(QWheelEvent* e)
+{
+	if (d->live_paused && (e->modifiers() & Qt::ControlModifier))
+	{
+		if (e->delta() != 0)
+		{
+			stepHistory(e->delta() > 0 ? 1 : -1);
+		}
+		return;
+	}
+	if (e->delta() > 0)
+	{
+		d->zoomIn(e);
+	}
+	else if (e->delta() < 0)
+	{
+		d->zoomOut(e);
+	}
+}
+
+//元素外接矩形的均匀网格索引，每次提交构建一次，绘制时只查询可见区域
+class PaintGridIndex
+{
+public:
+	PaintGridIndex() :
+		cols(0),
+		rows(0),
+		cell(1.),
+		stamp(0)
+	{
+	}
+
+	bool isBuilt() const
+	{
+		return cols > 0;
+	}
+
+	void build(const std::vector<QRectF>& boxes)
+	{
+		if (boxes.size() < min_items)
+		{
+			return;
+		}
+		double left(boxes[0].left()), top(boxes[0].top()), right(boxes[0].right()), bottom(boxes[0].bottom());
+		for (const auto& b : boxes)
+		{
+			left = std::min(left, b.left());
+			top = std::min(top, b.top());
+			right = std::max(right, b.right());
+			bottom = std::max(bottom, b.bottom());
+		}
+		bounds = QRectF(QPointF(left, top), QPointF(right, bottom));
+		auto area = std::max(1., bounds.width() * bounds.height());
+		cell = std::max(1., std::sqrt(area / double(std::max<size_t>(1, boxes.size() / 4))));
+		cell = std::max({ cell, bounds.width() / max_cells_per_side, bounds.height() / max_cells_per_side });
+		cols = std::max(1, int(std::ceil(bounds.width() / cell)));
+		rows = std::max(1, int(std::ceil(bounds.height() / cell)));
+		std::vector<int> counts(size_t(cols) * rows + 1, 0);
+		auto for_cells = [this](const QRectF& b, const std::function<void(const int&)>& func) {
+			int c0, r0, c1, r1;
+			cellRange(b, c0, r0, c1, r1);
+			for (int r = r0; r <= r1; r++)
+			{
+				for (int c = c0; c <= c1; c++)
+				{
+					func(r * cols + c);
+				}
+			}
+		};
+		for (size_t i = 0; i < boxes.size(); i++)
+		{
+			if (isLarge(boxes[i]))
+			{
+				large_items.push_back(int(i));
+				continue;
+			}
+			for_cells(boxes[i], [&counts](const int& c) { counts[c + 1]++; });
+		}
+		for (size_t i = 1; i < counts.size(); i++)
+		{
+			counts[i] += counts[i - 1];
+		}
+		cell_start = counts;
+		items.resize(counts.back());
+		for (size_t i = 0; i < boxes.size(); i++)
+		{
+			if (isLarge(boxes[i]))
+			{
+				continue;
+			}
+			for_cells(boxes[i], [this, &counts, i](const int& c) { items[counts[c]++] = int(i); });
+		}
+		stamps.assign(boxes.size(), 0);
+	}
+
+	//返回与window相交的元素序号，保持原始顺序
+	void query(const QRectF& window, const std::vector<QRectF>& boxes, std::vector<int>& out) const
+	{
+		out.clear();
+		if (!intersects(window, bounds))
+		{
+			return;
+		}
+		stamp++;
+		if (stamp == 0)
+		{
+			std::fill(stamps.begin(), stamps.end(), 0);
+			stamp = 1;
+		}
+		int c0, r0, c1, r1;
+		cellRange(window, c0, r0, c1, r1);
+		for (int r = r0; r <= r1; r++)
+		{
+			for (int c = c0; c <= c1; c++)
+			{
+				auto idx = r * cols + c;
+				for (int k = cell_start[idx]; k < cell_start[idx + 1]; k++)
+				{
+					auto i = items[k];
+					if (stamps[i] != stamp && intersects(boxes[i], window))
+					{
+						stamps[i] = stamp;
+						out.push_back(i);
+					}
+				}
+			}
+		}
+		for (const auto& i : large_items)
+		{
+			if (intersects(boxes[i], window))
+			{
+				out.push_back(i);
+			}
+		}
+		std::sort(out.begin(), out.end());
+	}
+
+	//可见区域覆盖大部分元素时直接全部绘制
+	bool coversAll(const QRectF& window) const
+	{
+		return window.left() <= bounds.left() && window.right() >= bounds.right() && window.top() <= bounds.top() && window.bottom() >= bounds.bottom();
+	}
+private:
+	static const size_t min_items = 256;
+	static const int max_cells_per_item = 64;
+	static constexpr double max_cells_per_side = 4096.;
+
+	static bool intersects(const QRectF& a, const QRectF& b)
+	{
+		return a.left() <= b.right() && a.right() >= b.left() && a.top() <= b.bottom() && a.bottom() >= b.top();
+	}
+
+	void cellRange(const QRectF& b, int& c0, int& r0, int& c1, int& r1) const
+	{
+		c0 = std::clamp(int((b.left() - bounds.left()) / cell), 0, cols - 1);
+		r0 = std::clamp(int((b.top() - bounds.top()) / cell), 0, rows - 1);
+		c1 = std::clamp(int((b.right() - bounds.left()) / cell), 0, cols - 1);
+		r1 = std::clamp(int((b.bottom() - bounds.top()) / cell), 0, rows - 1);
+	}
+
+	bool isLarge(const QRectF& b) const
+	{
+		int c0, r0, c1, r1;
+		cellRange(b, c0, r0, c1, r1);
+		return (c1 - c0 + 1) * (r1 - r0 + 1) > max_cells_per_item;
+	}
+
+	QRectF bounds;
+	int cols;
+	int rows;
+	double cell;
+	std::vector<int> cell_start;
+	std::vector<int> items;
+	std::vector<int> large_items;
+	mutable std::vector<quint32> stamps;
+	mutable quint32 stamp;
+};
+
+//选框注册表：链表保存z序（表头最先命中、最先绘制），id与名字各建哈希索引，增删、置顶和查找均为常数时间
+//索引键记录在条目中，框的id或名字变化时按旧键重建索引，框析构后也能正确移除
+//另以外接矩形建均匀网格，命中测试只对所在单元中的候选框做精确判断
+class ImageBoxRegistry
+{
+public:
+	typedef std::list<ImageBox*>::iterator iterator;
+
+	iterator begin()
+	{
+		return order.begin();
+	}
+
+	iterator end()
+	{
+		return order.end();
+	}
+
+	bool empty() const
+	{
+		return order.empty();
+	}
+
+	int size() const
+	{
+		return int(order.size());
+	}
+
+	bool contains(ImageBox* box) const
+	{
+		return entries.find(box) != entries.end();
+	}
+
+	//不在表中时插入，否则移到表头
+	void pushFront(ImageBox* box)
+	{
+		auto iter = entries.find(box);
+		if (iter != entries.end())
+		{
+			order.splice(order.begin(), order, iter->second.pos);
+			iter->second.stamp = --front_stamp;
+			return;
+		}
+		order.push_front(box);
+		Entry entry;
+		entry.pos = order.begin();
+		entry.stamp = --front_stamp;
+		entry.id = box->getBoxID();
+		entry.name = box->getName();
+		auto& inserted = entries.emplace(box, entry).first->second;
+		index(box, inserted);
+		place(box, inserted);
+	}
+
+	//插入到表尾（最下层），已在表中时不调整次序
+	void pushBack(ImageBox* box)
+	{
+		if (entries.find(box) != entries.end())
+			return;
+		order.push_back(box);
+		Entry entry;
+		entry.pos = std::prev(order.end());
+		entry.stamp = ++back_stamp;
+		entry.id = box->getBoxID();
+		entry.name = box->getName();
+		auto& inserted = entries.emplace(box, entry).first->second;
+		index(box, inserted);
+		place(box, inserted);
+	}
+
+	bool remove(ImageBox* box)
+	{
+		auto iter = entries.find(box);
+		if (iter == entries.end())
+			return false;
+		unindex(box, iter->second);
+		unplace(box, iter->second);
+		order.erase(iter->second.pos);
+		entries.erase(iter);
+		return true;
+	}
+
+	//id或名字变化后调用
+	void reindex(ImageBox* box)
+	{
+		auto iter = entries.find(box);
+		if (iter == entries.end())
+			return;
+		auto& entry = iter->second;
+		if (entry.id == box->getBoxID() && entry.name == box->getName())
+			return;
+		unindex(box, entry);
+		entry.id = box->getBoxID();
+		entry.name = box->getName();
+		index(box, entry);
+	}
+
+	//外接矩形变化后调用
+	void updateBounds(ImageBox* box)
+	{
+		auto iter = entries.find(box);
+		if (iter == entries.end())
+			return;
+		auto& entry = iter->second;
+		auto cells = cellsOf(box->getBoundingRect());
+		if (cells == entry.cells)
+			return;
+		unplace(box, entry);
+		place(box, entry, cells);
+	}
+
+	//返回z序最前、包含该点的框
+	ImageBox* hitTest(const QPoint& p)
+	{
+		hit_candidates.clear();
+		auto iter = grid.find(cellKey(floorDiv(p.x()), floorDiv(p.y())));
+		if (iter != grid.end())
+		{
+			for (auto box : iter->second)
+			{
+				hit_candidates.emplace_back(entries.at(box).stamp, box);
+			}
+		}
+		for (auto box : large_boxes)
+		{
+			hit_candidates.emplace_back(entries.at(box).stamp, box);
+		}
+		std::sort(hit_candidates.begin(), hit_candidates.end());
+		for (const auto& a : hit_candidates)
+		{
+			if (a.second->isInBox(p))
+			{
+				return a.second;
+			}
+		}
+		return nullptr;
+	}
+
+	ImageBox* findId(const int& id) const
+	{
+		if (id == -1)
+			return nullptr;
+		auto iter = by_id.constFind(id);
+		return iter == by_id.constEnd() ? nullptr : iter.value();
+	}
+
+	//按z序返回
+	QList<ImageBox*> findName(const QString& name) const
+	{
+		QList<ImageBox*> out;
+		auto iter = by_name.constFind(name);
+		if (iter == by_name.constEnd())
+			return out;
+		std::vector<std::pair<qint64, ImageBox*>> sorted;
+		sorted.reserve(iter.value().size());
+		for (auto box : iter.value())
+		{
+			sorted.emplace_back(entries.at(box).stamp, box);
+		}
+		std::sort(sorted.begin(), sorted.end());
+		out.reserve(int(sorted.size()));
+		for (const auto& a : sorted)
+		{
+			out.push_back(a.second);
+		}
+		return out;
+	}
+
+	void clear()
+	{
+		order.clear();
+		entries.clear();
+		by_id.clear();
+		by_name.clear();
+		grid.clear();
+		large_boxes.clear();
+	}
+private:
+	struct Entry
+	{
+		iterator pos;
+		qint64 stamp = 0;
+		int id = -1;
+		QString name;
+		//所占网格单元范围，空表示放在large_boxes中
+		QRect cells;
+	};
+
+	//超过该数量单元的框不进网格，每次命中测试都作为候选
+	static const int max_box_cells = 256;
+
+	static int floorDiv(const double& v)
+	{
+		return int(std::floor(v / box_grid_cell));
+	}
+
+	static quint64 cellKey(const int& cx, const int& cy)
+	{
+		return (quint64(quint32(cx)) << 32) | quint32(cy);
+	}
+
+	static QRect cellsOf(const QRectF& bounds)
+	{
+		auto b = bounds.normalized();
+		if (bounds.isNull())
+			return QRect();
+		QRect cells(QPoint(floorDiv(b.left()), floorDiv(b.top())), QPoint(floorDiv(b.right()), floorDiv(b.bottom())));
+		if (qint64(cells.width()) * cells.height() > max_box_cells)
+			return QRect();
+		return cells;
+	}
+
+	void place(ImageBox* box, Entry& entry)
+	{
+		place(box, entry, cellsOf(box->getBoundingRect()));
+	}
+
+	void place(ImageBox* box, Entry& entry, const QRect& cells)
+	{
+		entry.cells = cells;
+		if (cells.isNull())
+		{
+			large_boxes.insert(box);
+			return;
+		}
+		for (int cy = cells.top(); cy <= cells.bottom(); cy++)
+		{
+			for (int cx = cells.left(); cx <= cells.right(); cx++)
+			{
+				grid[cellKey(cx, cy)].push_back(box);
+			}
+		}
+	}
+
+	void unplace(ImageBox* box, const Entry& entry)
+	{
+		if (entry.cells.isNull())
+		{
+			large_boxes.remove(box);
+			return;
+		}
+		for (int cy = entry.cells.top(); cy <= entry.cells.bottom(); cy++)
+		{
+			for (int cx = entry.cells.left(); cx <= entry.cells.right(); cx++)
+			{
+				auto iter = grid.find(cellKey(cx, cy));
+				if (iter == grid.end())
+					continue;
+				auto& boxes = iter->second;
+				auto found = std::find(boxes.begin(), boxes.end(), box);
+				if (found != boxes.end())
+				{
+					*found = boxes.back();
+					boxes.pop_back();
+				}
+				if (boxes.empty())
+				{
+					grid.erase(iter);
+				}
+			}
+		}
+	}
+
+	void index(ImageBox* box, const Entry& entry)
+	{
+		if (entry.id != -1)
+		{
+			by_id.insert(entry.id, box);
+		}
+		by_name[entry.name].insert(box);
+	}
+
+	void unindex(ImageBox* box, const Entry& entry)
+	{
+		if (entry.id != -1)
+		{
+			auto iter = by_id.find(entry.id);
+			if (iter != by_id.end() && iter.value() == box)
+			{
+				by_id.erase(iter);
+			}
+		}
+		auto iter = by_name.find(entry.name);
+		if (iter != by_name.end())
+		{
+			iter.value().remove(box);
+			if (iter.value().isEmpty())
+			{
+				by_name.erase(iter);
+			}
+		}
+	}
+
+	std::list<ImageBox*> order;
+	std::unordered_map<ImageBox*, Entry> entries;
+	QHash<int, ImageBox*> by_id;
+	QHash<QString, QSet<ImageBox*>> by_name;
+	std::unordered_map<quint64, std::vector<ImageBox*>> grid;
+	QSet<ImageBox*> large_boxes;
+	std::vector<std::pair<qint64, ImageBox*>> hit_candidates;
+	qint64 front_stamp = 0;
+	qint64 back_stamp = 0;
+};
+
+class ImageWidgetPrivate : public QObject
+{
+	Q_OBJECT
+public:
+	ImageWidgetPrivate(ImageWidget* parent) :
+		q_ptr(parent),
+		grabed_box_ptr(nullptr),
+		is_painting(false),
+		grabed_obj(false),
+		grabed_edge(false),
+		new_box_tmp(nullptr),
+		light_index_dirty(false),
+		light_revision(0),
+		light_labels_revision(0),
+		box_snapshot_light_revision(0),
+		live_statistics(false)
+	{
+
+	}
+	~ImageWidgetPrivate()
+	{
+
+	}
+	//加入注册表并跟踪id、名字变化与析构，已在表中时移到表头；front为false时插入到QObject选框的最下层
+	void attachBox(ImageBox* box, const bool& front = true)
+	{
+		if (!box_list.contains(box))
+		{
+			connect(box, &ImageBox::boxIDChanged, this, [this, box]() { box_list.reindex(box); });
+			connect(box, &ImageBox::nameChanged, this, [this, box]() { box_list.reindex(box); });
+			connect(box, &ImageBox::geometryChanged, this, [this, box]() { box_list.updateBounds(box); });
+			connect(box, &QObject::destroyed, this, [this, box]() { forgetBox(box); });
+			if (!front)
+			{
+				box_list.pushBack(box);
+				return;
+			}
+		}
+		box_list.pushFront(box);
+	}
+
+	//移除与box的id相同的其他选框（包括轻量选框），id为-1时不处理
+	void releaseDuplicate(const int& id, ImageBox* except)
+	{
+		if (id == -1)
+			return;
+		auto old_box = box_list.findId(id);
+		if (old_box && old_box != except)
+		{
+			releaseBox(old_box);
+		}
+		removeLightId(id);
+	}
+
+	void addLightBox(const ImageBoxData& data)
+	{
+		if (data.id != -1)
+		{
+			auto old_box = box_list.findId(data.id);
+			if (old_box)
+			{
+				releaseBox(old_box);
+			}
+			auto iter = light_ids.constFind(data.id);
+			if (iter != light_ids.constEnd())
+			{
+				light_boxes[iter.value()] = data;
+				touchLight();
+				return;
+			}
+			light_ids.insert(data.id, light_boxes.size());
+		}
+		light_boxes.push_back(data);
+		touchLight();
+	}
+
+	//与末尾交换后删除，O(1)，绘制次序随之变化
+	void removeLightAt(const size_t& i)
+	{
+		if (light_boxes[i].id != -1)
+		{
+			light_ids.remove(light_boxes[i].id);
+		}
+		if (i + 1 != light_boxes.size())
+		{
+			light_boxes[i] = std::move(light_boxes.back());
+			if (light_boxes[i].id != -1)
+			{
+				light_ids[light_boxes[i].id] = i;
+			}
+		}
+		light_boxes.pop_back();
+		touchLight();
+	}
+
+	bool removeLightId(const int& id)
+	{
+		auto iter = light_ids.constFind(id);
+		if (id == -1 || iter == light_ids.constEnd())
+			return false;
+		removeLightAt(iter.value());
+		return true;
+	}
+
+	void removeLightName(const QString& name)
+	{
+		auto end = std::remove_if(light_boxes.begin(), light_boxes.end(), [&name](const ImageBoxData& a) { return a.name == name; });
+		if (end == light_boxes.end())
+			return;
+		light_boxes.erase(end, light_boxes.end());
+		rebuildLightIds();
+		touchLight();
+	}
+
+	void clearLight()
+	{
+		light_boxes.clear();
+		light_ids.clear();
+		touchLight();
+	}
+
+	void rebuildLightIds()
+	{
+		light_ids.clear();
+		for (size_t i = 0; i < light_boxes.size(); i++)
+		{
+			if (light_boxes[i].id != -1)
+			{
+				light_ids.insert(light_boxes[i].id, i);
+			}
+		}
+	}
+
+	void touchLight()
+	{
+		light_revision++;
+		light_index_dirty = true;
+	}
+
+	void rebuildLightIndex()
+	{
+		if (!light_index_dirty)
+			return;
+		light_bounds.clear();
+		light_bounds.reserve(light_boxes.size());
+		for (const auto& a : light_boxes)
+		{
+			light_bounds.push_back(QRectF(a.x, a.y, a.width, a.height).normalized());
+		}
+		light_index = PaintGridIndex();
+		light_index.build(light_bounds);
+		light_index_dirty = false;
+	}
+
+	//轻量选框按加入顺序绘制，后加入的在上层，返回命中的最上层序号
+	int hitLight(const QPoint& p)
+	{
+		rebuildLightIndex();
+		auto hit = [this, &p](const size_t& i) {
+			const auto& b = light_bounds[i];
+			return light_boxes[i].display && p.x() >= b.left() && p.x() <= b.right() && p.y() >= b.top() && p.y() <= b.bottom();
+		};
+		if (!light_index.isBuilt())
+		{
+			for (size_t i = light_boxes.size(); i-- > 0;)
+			{
+				if (hit(i))
+					return int(i);
+			}
+			return -1;
+		}
+		light_index.query(QRectF(p, QSizeF(0., 0.)), light_bounds, light_candidates);
+		for (auto iter = light_candidates.rbegin(); iter != light_candidates.rend(); iter++)
+		{
+			if (hit(size_t(*iter)))
+				return *iter;
+		}
+		return -1;
+	}
+
+	//把轻量选框提升为QObject选框；front为false时放在QObject选框的最下层，即紧贴原先所在的轻量选框层，不改变与其他QObject选框的上下关系
+	ImageBox* promoteLight(const size_t& i, const bool& front = true)
+	{
+		auto data = light_boxes[i];
+		removeLightAt(i);
+		QBrush brush(QColor(data.color.red(), data.color.green(), data.color.blue(), 0), Qt::BrushStyle::SolidPattern);
+		ImageBox* box(nullptr);
+		if (data.shape == ImageBoxData::Ellipse)
+		{
+			box = new EllipseImageBox(data.x, data.y, data.width, data.height, QPen(data.color), brush, data.name, data.id, data.display, data.env, q_ptr);
+		}
+		else
+		{
+			box = new RectImageBox(data.x, data.y, data.width, data.height, QPen(data.color), brush, data.name, data.id, data.display, data.env, q_ptr);
+		}
+		box->setBoxID(data.id);
+		attachBox(box, front);
+		return box;
+	}
+
+	//先测QObject选框，再测其下的轻量选框，命中轻量选框时提升
+	ImageBox* hitTestAll(const QPoint& p)
+	{
+		auto hit = box_list.hitTest(p);
+		if (hit)
+			return hit;
+		auto i = hitLight(p);
+		return i < 0 ? nullptr : promoteLight(size_t(i));
+	}
 
-	painter_ptr->drawPixmap(QRectF(0, 0, width(), height()), *tmp_img, QRectF(d->source_position, d->source_size));
-	(d->done_flag ? d->done_paint_data : d->paint_data).paintDatas(painter_ptr, d);
-#ifndef IMAGEWIDGET_QML
-	painter_ptr->end();
-#endif
-}
+	void paintLightBoxes(QPainter* painter, ImageWidgetBasePrivate* d)
+	{
+		static const int label_font = FontFamilyTable::instance().intern("Microsoft YaHei");
+		rebuildLightIndex();
+		//标签按序号缓存，轻量选框变化（light_revision改变）时整体作废，缩放平移重绘时复用
+		if (light_labels_revision != light_revision || light_labels.size() != light_boxes.size())
+		{
+			light_labels.assign(light_boxes.size(), QString());
+			light_labels_revision = light_revision;
+		}
+		auto window = d->getVisibleImageRect();
+		auto paint_one = [&](const size_t& i) {
+			const auto& a = light_boxes[i];
+			if (!a.display)
+				return;
+			QPen pen(a.color);
+			painter->setPen(pen);
+			painter->setBrush(Qt::NoBrush);
+			auto rect = d->getPaintRect<QRectF>(QRectF(a.x, a.y, a.width, a.height));
+			painter->drawRect(rect);
+			if (a.shape == ImageBoxData::Ellipse)
+			{
+				painter->drawEllipse(rect);
+			}
+			auto& label = light_labels[i];
+			if (label.isNull())
+			{
+				label = "Name:" + a.name + QString(" (%1,%2,%3,%4)").arg(QString::number(int(a.x)), QString::number(int(a.y)), QString::number(int(a.width)), QString::number(int(a.height)));
+			}
+			d->drawCachedText(painter, d->getPaintPosition<QPointF>(QPoint(a.x, a.y)), label, label_font, 16);
+		};
+		if (!light_index.isBuilt() || light_index.coversAll(window))
+		{
+			for (size_t i = 0; i < light_boxes.size(); i++)
+			{
+				paint_one(i);
+			}
+			return;
+		}
+		light_index.query(window, light_bounds, light_candidates);
+		for (const auto& i : light_candidates)
+		{
+			paint_one(size_t(i));
+		}
+	}
 
-void ImageWidgetBase::wheelEvent(QWheelEvent* e)
-{
-	if (e->delta() > 0)
+	static bool sameBoxData(const ImageBoxData& a, const ImageBoxData& b)
 	{
-		d->zoomIn(e);
+		return a.shape == b.shape && a.id == b.id && a.name == b.name && a.x == b.x && a.y == b.y && a.width == b.width && a.height == b.height && a.color == b.color && a.display == b.display && a.env == b.env;
 	}
-	else if (e->delta() < 0)
+
+	//录制用的选框快照，轻量选框未变（light_revision相同）且QObject选框逐个比较相同时返回上一次的同一个对象
+	//QObject选框的画笔、显示等属性没有变化通知，只能逐个比较，数量通常远少于轻量选框
+	std::shared_ptr<const std::vector<ImageBoxData>> boxSnapshot()
 	{
-		d->zoomOut(e);
+		auto same = box_snapshot_cache && box_snapshot_light_revision == light_revision && box_snapshot_cache->size() == size_t(box_list.size()) + light_boxes.size();
+		size_t i(0);
+		for (auto iter = box_list.begin(); same && iter != box_list.end(); iter++)
+		{
+			same = sameBoxData((*box_snapshot_cache)[i++], (*iter)->getData());
+		}
+		if (!same)
+		{
+			box_snapshot_cache = std::make_shared<const std::vector<ImageBoxData>>(q_ptr->getImageBoxData());
+			box_snapshot_light_revision = light_revision;
+		}
+		return box_snapshot_cache;
 	}
-}
 
-class ImageWidgetPrivate : public QObject
-{
-	Q_OBJECT
-public:
-	ImageWidgetPrivate(ImageWidget* parent) :
-		q_ptr(parent),
-		grabed_box_ptr(nullptr),
-		is_painting(false),
-		grabed_obj(false),
-		grabed_edge(false)
+	//只有确切类型为RectImageBox/EllipseImageBox时按getData()解析形状，派生类可能重写了getMask，按自定义选框处理
+	static SelectedBox selectionOf(ImageBox* box)
+	{
+		SelectedBox out;
+		out.data = box->getData();
+		const auto& type = typeid(*box);
+		if (type != typeid(RectImageBox) && type != typeid(EllipseImageBox))
+		{
+			out.custom = box;
+		}
+		return out;
+	}
+
+	//按id选取选框，轻量选框不提升，不存在的id被忽略
+	std::vector<SelectedBox> selectByIds(const QList<int>& ids)
 	{
+		std::vector<SelectedBox> out;
+		out.reserve(size_t(ids.size()));
+		for (const auto& id : ids)
+		{
+			auto box = box_list.findId(id);
+			if (box)
+			{
+				out.push_back(selectionOf(box));
+				continue;
+			}
+			auto iter = light_ids.constFind(id);
+			if (id != -1 && iter != light_ids.constEnd())
+			{
+				out.push_back({ light_boxes[iter.value()], nullptr });
+			}
+		}
+		return out;
+	}
 
+	std::vector<SelectedBox> selectByName(const QString& name)
+	{
+		std::vector<SelectedBox> out;
+		for (auto box : box_list.findName(name))
+		{
+			out.push_back(selectionOf(box));
+		}
+		for (auto iter = light_boxes.rbegin(); iter != light_boxes.rend(); iter++)
+		{
+			if (iter->name == name)
+			{
+				out.push_back({ *iter, nullptr });
+			}
+		}
+		return out;
 	}
-	~ImageWidgetPrivate()
+
+	//移出注册表并延迟删除
+	void releaseBox(ImageBox* box)
 	{
+		forgetBox(box);
+		disconnect(box, nullptr, this, nullptr);
+		box->deleteLater();
+	}
 
+	void forgetBox(ImageBox* box)
+	{
+		box_list.remove(box);
+		if (grabed_box_ptr == box)
+		{
+			grabed_box_ptr = nullptr;
+		}
 	}
+
 	void normalizeAllBox()
 	{
 		for (auto& a : box_list)
@@ -692,6 +5589,54 @@ public:
 		}
 	}
 
+	//自定义选框的区间在提交时取出，矩形、椭圆在导出线程中按值类型形状生成
+	quint64 exportMask(ImageWidgetBasePrivate* d, const SelectedBox& box, const QString& file)
+	{
+		auto size = d->getImageSize();
+		cv::Size cv_size(size.width(), size.height());
+		if (box.custom)
+		{
+			auto spans = box.custom->getMaskSpans(size);
+			return d->enqueueExport(file, [spans, cv_size]() {
+				cv::Mat mask(cv_size, CV_8UC1, cv::Scalar(0));
+				for (const auto& a : spans)
+				{
+					auto row = mask.ptr<uchar>(a.y);
+					std::memset(row + a.x0, 255, size_t(a.x1 - a.x0));
+				}
+				return mask;
+			});
+		}
+		auto data = box.data;
+		return d->enqueueExport(file, [data, cv_size]() {
+			return composeMask({ { data, nullptr } }, ImageWidget::MaskUnion, cv_size);
+		});
+	}
+
+	//正在拖动或缩放的选框，拖边时为表头选框
+	ImageBox* draggedBox()
+	{
+		if (grabed_edge && !box_list.empty())
+		{
+			return *box_list.begin();
+		}
+		return grabed_box_ptr;
+	}
+
+	//积分图未就绪时只请求构建，就绪后由integralReady补发
+	void emitLiveStatistics(ImageWidgetBasePrivate* d)
+	{
+		if (!live_statistics)
+			return;
+		auto box = draggedBox();
+		if (!box)
+			return;
+		auto tables = d->currentIntegral();
+		if (!tables)
+			return;
+		emit q_ptr->liveRoiStatisticsChanged(integralStatistics(*tables, selectionOf(box)));
+	}
+
 	void checkPress(const QPoint& p, const double& power)
 	{
 		if (box_list.empty())
@@ -710,6 +5655,51 @@ public:
 			grabed_edge = false;
 		}
 	}
+	//最后一个编辑中的框及其之前的框实时绘制，其后未编辑的框按视口缓存，拖动时只重绘编辑中的框
+	void paintBoxes(QPainter* painter, ImageWidgetBasePrivate* d)
+	{
+		//轻量选框在所有QObject选框之下
+		if (light_boxes.empty())
+		{
+			light_raster.release();
+		}
+		else
+		{
+			light_raster.paint(painter, d->currentViewport(painter), nullptr, light_revision, [this, d](QPainter* p) {
+				paintLightBoxes(p, d);
+			});
+		}
+		auto live = box_list.begin();
+		for (auto iter = box_list.begin(); iter != box_list.end(); iter++)
+		{
+			if ((*iter)->getEditing())
+			{
+				live = std::next(iter);
+			}
+		}
+		for (auto iter = box_list.begin(); iter != live; iter++)
+		{
+			(*iter)->paintShape(painter, d);
+		}
+		if (live == box_list.end())
+		{
+			box_raster.release();
+			return;
+		}
+		//版本号全局唯一，按顺序组合即可反映框的增删、次序和内容变化
+		quint64 signature = 14695981039346656037ull;
+		for (auto iter = live; iter != box_list.end(); iter++)
+		{
+			signature = (signature ^ (*iter)->revision) * 1099511628211ull;
+		}
+		box_raster.paint(painter, d->currentViewport(painter), nullptr, signature, [this, d, live](QPainter* p) {
+			for (auto iter = live; iter != box_list.end(); iter++)
+			{
+				(*iter)->paintShape(p, d);
+			}
+		});
+	}
+
 	bool checkMove(const QPoint& p, const double& power)
 	{
 		if (box_list.empty())
@@ -730,7 +5720,7 @@ public:
 
 private:
 	friend ImageWidget;
-	QList<ImageBox*> box_list;
+	ImageBoxRegistry box_list;
 	ImageWidget* q_ptr;
 	bool is_painting;
 	ImageBox* grabed_box_ptr;
@@ -739,6 +5729,24 @@ private:
 	bool grabed_edge;
 	ImageBox::GrabedEdgeType grabed_type;
 	ImageBox* new_box_tmp;
+	RetainedRaster box_raster;
+
+	std::vector<ImageBoxData> light_boxes;
+	QHash<int, size_t> light_ids;
+	std::vector<QRectF> light_bounds;
+	PaintGridIndex light_index;
+	std::vector<int> light_candidates;
+	bool light_index_dirty;
+	quint64 light_revision;
+	RetainedRaster light_raster;
+	std::vector<QString> light_labels;
+	quint64 light_labels_revision;
+	std::shared_ptr<const std::vector<ImageBoxData>> box_snapshot_cache;
+	quint64 box_snapshot_light_revision;
+
+	bool live_statistics;
+	//右键菜单发起的导出，失败时提示
+	QSet<quint64> menu_exports;
 };
 
 #ifdef IMAGEWIDGET_QML
@@ -753,12 +5761,31 @@ ImageWidget::ImageWidget(QWidget* parent)
 	setKeepMouseGrab(false);
 #else
 	setMouseTracking(true);
+#endif
+	qRegisterMetaType<ImageWidget::LiveRoiStatistics>("ImageWidget::LiveRoiStatistics");
+	connect(d, &ImageWidgetBasePrivate::integralReady, this, [this]() { d_ptr->emitLiveStatistics(d); });
+	d->box_snapshot = [this]() { return d_ptr->boxSnapshot(); };
+	d->box_raster_bytes = [this]() { return d_ptr->box_raster.bytes() + d_ptr->light_raster.bytes(); };
+	d->release_box_rasters = [this]() {
+		d_ptr->box_raster.release();
+		d_ptr->light_raster.release();
+	};
+#ifndef IMAGEWIDGET_QML
+	connect(this, &ImageWidgetBase::exportFinished, this, [this](quint64 id, const QString&, bool ok) {
+		if (d_ptr->menu_exports.remove(id) && !ok)
+		{
+			QMessageBox::warning(this, "警告", "输出失败");
+		}
+	});
 #endif
 }
 
 
 ImageWidget::~ImageWidget()
 {
+	d->box_snapshot = nullptr;
+	d->box_raster_bytes = nullptr;
+	d->release_box_rasters = nullptr;
 	delete d_ptr;
 }
 
@@ -769,7 +5796,7 @@ void ImageWidget::mousePressEvent(QMouseEvent* e)
 		//正在画图
 		if (d_ptr->is_painting)
 		{
-			d_ptr->box_list.push_front(d_ptr->new_box_tmp);
+			d_ptr->attachBox(d_ptr->new_box_tmp);
 			d_ptr->new_box_tmp = nullptr;
 			d_ptr->grabed_box_ptr = *(d_ptr->box_list.begin());
 			d_ptr->grabed_box_ptr->setEditing(true);
@@ -786,23 +5813,15 @@ void ImageWidget::mousePressEvent(QMouseEvent* e)
 			update();
 			return;
 		}
-		bool flag(false);
-		decltype(d_ptr->box_list.begin()) iter(d_ptr->box_list.begin());
-		for (auto& a : d_ptr->box_list)
+		auto hit = d_ptr->hitTestAll(pos);
+		if (hit)
 		{
-			if (a->isInBox(pos))
-			{
-				auto tmp = *iter;
-				d_ptr->box_list.erase(iter);
-				d_ptr->box_list.push_front(tmp);
-				d_ptr->grabed_box_ptr = *d_ptr->box_list.begin();
-				d_ptr->resetBoxEditing();
-				d_ptr->grabed_box_ptr->setEditing(true);
-				d_ptr->start_point = e->pos();
-				flag = true;
-				break;
-			}
-			iter++;
+			d_ptr->box_list.pushFront(hit);
+			d_ptr->grabed_box_ptr = hit;
+			d_ptr->resetBoxEditing();
+			d_ptr->grabed_box_ptr->setEditing(true);
+			d_ptr->start_point = e->pos();
+			d_ptr->emitLiveStatistics(d);
 		}
 		if (d_ptr->grabed_box_ptr == nullptr)
 		{
@@ -836,6 +5855,7 @@ void ImageWidget::mouseMoveEvent(QMouseEvent* e)
 		auto box_ptr = d_ptr->box_list.begin();
 		QRect new_rt;
 		(*box_ptr)->editEdge(d_ptr->grabed_type, m);
+		d_ptr->emitLiveStatistics(d);
 		update();
 	}
 #ifndef IMAGEWIDGET_QML
@@ -907,6 +5927,7 @@ void ImageWidget::mouseMoveEvent(QMouseEvent* e)
 		d->getMovedBox(*d_ptr->grabed_box_ptr, d_ptr->start_point, m);
 		d_ptr->start_point = m;
 	}
+	d_ptr->emitLiveStatistics(d);
 	update();
 }
 
@@ -920,7 +5941,7 @@ void ImageWidget::mouseReleaseEvent(QMouseEvent* e)
 	d_ptr->normalizeAllBox();
 	if (d_ptr->is_painting)
 	{
-		for (auto iter = d_ptr->box_list.begin() + 1; iter != d_ptr->box_list.end(); iter++)
+		for (auto iter = std::next(d_ptr->box_list.begin()); iter != d_ptr->box_list.end(); iter++)
 		{
 			(*iter)->setEditing(false);
 		}
@@ -951,10 +5972,7 @@ void ImageWidget::paintEvent(QPaintEvent* e)
 	QPainter* painter_ptr = &painter_obj;
 	painter_ptr->begin(this);
 #endif
-	for (auto& a : d_ptr->box_list)
-	{
-		a->paintShape(painter_ptr, d);
-	}
+	d_ptr->paintBoxes(painter_ptr, d);
 #ifndef IMAGEWIDGET_QML
 	painter_ptr->end();
 #endif
@@ -970,47 +5988,29 @@ void ImageWidget::contextMenuEvent(QContextMenuEvent* e)
 {
 
 	QMenu menu;
-	decltype(d_ptr->box_list.begin()) selected_iter(d_ptr->box_list.end());
-	for (auto iter = d_ptr->box_list.begin(); iter != d_ptr->box_list.end(); iter++)
+	auto selected = d_ptr->hitTestAll(d->getImagePosition<QPoint>(e->pos()));
+	if (selected)
 	{
-		auto pos = d->getImagePosition<QPoint>(e->pos());
-		if ((*iter)->isInBox(pos))
-		{
-			selected_iter = iter;
-			break;
-		}
-	}
-	if (selected_iter != d_ptr->box_list.end())
-	{
-		auto new_box = *selected_iter;
-		new_box->setEditing(true);
-		d_ptr->box_list.erase(selected_iter);
-		d_ptr->box_list.push_front(new_box);
-		for (auto iter = d_ptr->box_list.begin() + 1; iter != d_ptr->box_list.end(); iter++)
+		selected->setEditing(true);
+		d_ptr->box_list.pushFront(selected);
+		for (auto iter = std::next(d_ptr->box_list.begin()); iter != d_ptr->box_list.end(); iter++)
 		{
 			(*iter)->setEditing(false);
 		}
 		update();
-		selected_iter = d_ptr->box_list.begin();
 		QAction env_action("反向");
 		env_action.setCheckable(true);
-		env_action.setChecked((*selected_iter)->isEnv());
-		connect(&env_action, &QAction::triggered, [this, &selected_iter, &env_action]() {
-			(*selected_iter)->setIsEnv(env_action.isChecked());
+		env_action.setChecked(selected->isEnv());
+		connect(&env_action, &QAction::triggered, [this, selected, &env_action]() {
+			selected->setIsEnv(env_action.isChecked());
 			update();
 			});
 		QAction outmask_action("输出Mask图片");
-		connect(&outmask_action, &QAction::triggered, [this, &selected_iter, &outmask_action]() {
+		connect(&outmask_action, &QAction::triggered, [this, selected]() {
 			auto fn = QFileDialog::getSaveFileName(this, "选择文件", "./img.png", "Image (*.png *.bmp *.jpg)");
-			try
-			{
-				cv::imwrite(fn.toStdString(), (*selected_iter)->getMask(d->getImageSize()));
-			}
-			catch (const cv::Exception & e)
-			{
-				QMessageBox::warning(nullptr, "警告", "输出失败");
-
-			}
+			if (fn.isEmpty())
+				return;
+			d_ptr->menu_exports.insert(exportBoxMask(selected, fn));
 		});
 		menu.addAction(&env_action);
 		menu.addAction(&outmask_action);
@@ -1026,169 +6026,343 @@ void ImageWidget::contextMenuEvent(QContextMenuEvent* e)
 #else
 #endif // TEST
 	QAction save_img("输出原图");
+	save_img.setEnabled(hasCurrentSourceImage());
 	connect(&save_img, &QAction::triggered,this, [this]() {
 		auto fn = QFileDialog::getSaveFileName(this, "选择文件", "./img.png", "Image (*.png *.bmp *.jpg)");
-		try
-		{
-			cv::Mat tmp;
-			cv::cvtColor(d->rgb,tmp,cv::COLOR_RGB2BGR);
-			cv::imwrite(fn.toStdString(), tmp);
-		}
-		catch (const cv::Exception& e)
-		{
-			QMessageBox::warning(nullptr, "警告", "输出失败");
-
-		}
+		if (fn.isEmpty())
+			return;
+		d_ptr->menu_exports.insert(exportSourceImage(fn));
 		});
 
 	QAction save_pimg("输出绘制图片");
+	save_pimg.setEnabled(hasCurrentSourceImage());
 
 	connect(&save_pimg, &QAction::triggered,this, [this]() {
 		auto fn = QFileDialog::getSaveFileName(this, "选择文件", "./img.png", "Image (*.png *.bmp *.jpg)");
-
-		try
-		{
-			cv::Mat tmp;
-			cv::cvtColor(d->rgb,tmp,cv::COLOR_RGB2BGR);
-			d->paint_data.drawDatas(tmp);
-			cv::imwrite(fn.toStdString(), tmp);
-		}
-		catch (const cv::Exception & e)
-		{
-			QMessageBox::warning(nullptr,"警告", "输出失败");
-
-		}
+		if (fn.isEmpty())
+			return;
+		d_ptr->menu_exports.insert(exportPaintedImage(fn));
+		});
+	QAction pause_action("暂停");
+	pause_action.setCheckable(true);
+	pause_action.setChecked(isLivePaused());
+	connect(&pause_action, &QAction::triggered, this, [this, &pause_action]() {
+		setLivePaused(pause_action.isChecked());
+		});
+	QAction prev_action("上一帧");
+	prev_action.setEnabled(getFrameHistorySize() > 1 && (!isLivePaused() || getHistoryOffset() + 1 < getFrameHistorySize()));
+	connect(&prev_action, &QAction::triggered, this, [this]() {
+		stepHistory(1);
+		});
+	QAction next_action("下一帧");
+	next_action.setEnabled(isLivePaused() && getHistoryOffset() > 0);
+	connect(&next_action, &QAction::triggered, this, [this]() {
+		stepHistory(-1);
 		});
 	menu.addAction(&save_img);
 	menu.addAction(&save_pimg);
+	menu.addSeparator();
+	menu.addAction(&pause_action);
+	menu.addAction(&prev_action);
+	menu.addAction(&next_action);
 	menu.exec(e->globalPos());
 	return;
 }
-#endif
+#endif
+
+void ImageWidget::paintNewImageBox(ImageBox* box)
+{
+	d_ptr->releaseDuplicate(box->getBoxID(), box);
+	box->setParent(this);
+	d_ptr->is_painting = true;
+	d_ptr->new_box_tmp = box;
+}
+
+void ImageWidget::addImageBox(ImageBox* box)
+{
+	d_ptr->releaseDuplicate(box->getBoxID(), box);
+	box->setParent(this);
+	d_ptr->attachBox(box);
+	update();
+}
+
+void ImageWidget::addImageBoxes(const QList<ImageBox*>& boxes)
+{
+	for (auto box : boxes)
+	{
+		d_ptr->releaseDuplicate(box->getBoxID(), box);
+		box->setParent(this);
+		d_ptr->attachBox(box);
+	}
+	update();
+}
+
+void ImageWidget::addImageBoxData(const std::vector<ImageBoxData>& boxes)
+{
+	d_ptr->light_boxes.reserve(d_ptr->light_boxes.size() + boxes.size());
+	for (const auto& a : boxes)
+	{
+		d_ptr->addLightBox(a);
+	}
+	update();
+}
+
+void ImageWidget::removeImageBoxById(const int& id)
+{
+	auto box = d_ptr->box_list.findId(id);
+	if (box)
+	{
+		d_ptr->releaseBox(box);
+	}
+	else
+	{
+		d_ptr->removeLightId(id);
+	}
+	update();
+}
+
+void ImageWidget::removeImageBoxes(const QList<int>& ids)
+{
+	for (const auto& id : ids)
+	{
+		auto box = d_ptr->box_list.findId(id);
+		if (box)
+		{
+			d_ptr->releaseBox(box);
+		}
+		else
+		{
+			d_ptr->removeLightId(id);
+		}
+	}
+	update();
+}
+
+void ImageWidget::removeImageBoxByName(const QString& name)
+{
+	for (auto box : d_ptr->box_list.findName(name))
+	{
+		d_ptr->releaseBox(box);
+	}
+	d_ptr->removeLightName(name);
+	update();
+}
+
+void ImageWidget::paintNewImageBox(QVariant box)
+{
+	return paintNewImageBox(static_cast<ImageBox*>(box.value<QObject*>()));
+}
+void ImageWidget::addImageBox(QVariant box)
+{
+	auto val = static_cast<ImageBox*>(box.value<QObject*>());
+	addImageBox(val);
+}
+
+ImageBox* ImageWidget::getImageBoxFromId(const int& id)
+{
+	return d_ptr->box_list.findId(id);
+}
+
+ImageBox* ImageWidget::promoteBox(const int& id)
+{
+	auto box = d_ptr->box_list.findId(id);
+	if (box || id == -1)
+		return box;
+	auto iter = d_ptr->light_ids.constFind(id);
+	if (iter == d_ptr->light_ids.constEnd())
+		return nullptr;
+	box = d_ptr->promoteLight(iter.value(), false);
+	update();
+	return box;
+}
+
+bool ImageWidget::getImageBoxDataFromId(const int& id, ImageBoxData& data)
+{
+	auto box = d_ptr->box_list.findId(id);
+	if (box)
+	{
+		data = box->getData();
+		return true;
+	}
+	auto iter = d_ptr->light_ids.constFind(id);
+	if (id == -1 || iter == d_ptr->light_ids.constEnd())
+		return false;
+	data = d_ptr->light_boxes[iter.value()];
+	return true;
+}
+
+std::vector<ImageBoxData> ImageWidget::getImageBoxDataFromName(const QString& name)
+{
+	std::vector<ImageBoxData> out;
+	for (const auto& a : d_ptr->selectByName(name))
+	{
+		out.push_back(a.data);
+	}
+	return out;
+}
+
+QVariant ImageWidget::getImageBoxVarFromId(const int& id)
+{
+	QVariant var;
+	var.setValue( static_cast<QObject*>(promoteBox(id)));
+	return var;
+}
+
+QList<ImageBox*> ImageWidget::getImageBoxsFromName(const QString& name)
+{
+	return d_ptr->box_list.findName(name);
+}
+
+cv::Mat ImageWidget::composeMask(const QList<int>& ids, const int& rule, const QSize& size)
+{
+	auto sz = size.isEmpty() ? d->getImageSize() : size;
+	return ::composeMask(d_ptr->selectByIds(ids), rule, cv::Size(sz.width(), sz.height()));
+}
+
+cv::Mat ImageWidget::composeMaskByName(const QString& name, const int& rule, const QSize& size)
+{
+	auto sz = size.isEmpty() ? d->getImageSize() : size;
+	return ::composeMask(d_ptr->selectByName(name), rule, cv::Size(sz.width(), sz.height()));
+}
+
+std::vector<ImageWidget::RoiStatistics> ImageWidget::getRoiStatistics(const QList<int>& ids, const int& histogram_bins, const double& histogram_low, const double& histogram_high)
+{
+	auto mat = d->currentSourceMat();
+	if (mat.empty())
+		return {};
+	return roiStatistics(mat, d_ptr->selectByIds(ids), histogram_bins, histogram_low, histogram_high);
+}
+
+std::vector<ImageWidget::RoiStatistics> ImageWidget::getRoiStatisticsByName(const QString& name, const int& histogram_bins, const double& histogram_low, const double& histogram_high)
+{
+	auto mat = d->currentSourceMat();
+	if (mat.empty())
+		return {};
+	return roiStatistics(mat, d_ptr->selectByName(name), histogram_bins, histogram_low, histogram_high);
+}
 
-void ImageWidget::paintNewImageBox(ImageBox* box)
+std::vector<ImageWidget::RoiCrop> ImageWidget::getRoiCrops(const QList<int>& ids)
 {
-	for (auto iter = d_ptr->box_list.begin(); iter != d_ptr->box_list.end(); iter++)
-	{
-		if ((*iter)->getBoxID() == -1)
-			continue;
-		if ((*iter)->getBoxID() == box->getBoxID())
-		{
-			auto tmp = *iter;
-			d_ptr->box_list.erase(iter);
-			tmp->deleteLater();
-			d_ptr->box_list.push_front(box);
-			break;
-		}
-	}
-	box->setParent(this);
-	d_ptr->is_painting = true;
-	d_ptr->new_box_tmp = box;
+	auto mat = d->currentSourceMat();
+	if (mat.empty())
+		return {};
+	return roiCrops(mat, d_ptr->selectByIds(ids));
 }
 
-void ImageWidget::addImageBox(ImageBox* box)
+std::vector<ImageWidget::RoiCrop> ImageWidget::getRoiCropsByName(const QString& name)
 {
-	for (auto iter = d_ptr->box_list.begin(); iter != d_ptr->box_list.end(); iter++)
-	{
-		if ((*iter)->getBoxID() == -1)
-			continue;
-		if ((*iter)->getBoxID() == box->getBoxID())
-		{
-			auto tmp = *iter;
-			d_ptr->box_list.erase(iter);
-			tmp->deleteLater();
-			break;
-		}
-	}
-	box->setParent(this);
-	d_ptr->box_list.push_front(box);
-	update();
+	auto mat = d->currentSourceMat();
+	if (mat.empty())
+		return {};
+	return roiCrops(mat, d_ptr->selectByName(name));
 }
 
-void ImageWidget::removeImageBoxById(const int& id)
+void ImageWidget::packRoiCrops(const std::vector<RoiCrop>& crops, cv::Mat& batch, const QSize& size)
 {
-	for (auto iter = d_ptr->box_list.begin(); iter != d_ptr->box_list.end();iter++)
+	int type(-1), rows(size.height()), cols(size.width());
+	auto fit = size.isEmpty();
+	if (fit)
+	{
+		rows = 0;
+		cols = 0;
+	}
+	for (const auto& a : crops)
 	{
-		if ((*iter)->getBoxID() == id)
+		if (a.view.empty())
+			continue;
+		type = a.view.type();
+		if (fit)
 		{
-			auto tmp = *iter;
-			d_ptr->box_list.erase(iter);
-			tmp->deleteLater();
-			break;
+			rows = std::max(rows, a.view.rows);
+			cols = std::max(cols, a.view.cols);
 		}
 	}
-}
-
-void ImageWidget::removeImageBoxByName(const QString& name)
-{
-	while (true)
+	if (type == -1)
 	{
-		bool flag = false;
-		for (auto iter = d_ptr->box_list.begin(); iter != d_ptr->box_list.end(); iter++)
+		batch.release();
+		return;
+	}
+	int sizes[] = { int(crops.size()), rows, cols };
+	batch.create(3, sizes, type);
+	cv::parallel_for_(cv::Range(0, int(crops.size())), [&](const cv::Range& range) {
+		for (int i = range.start; i < range.end; i++)
 		{
-			if ((*iter)->getName() == name)
+			cv::Mat slot(rows, cols, type, batch.ptr(i));
+			const auto& view = crops[size_t(i)].view;
+			if (view.empty())
 			{
-				auto tmp = *iter;
-				d_ptr->box_list.erase(iter);
-				tmp->deleteLater();
-				flag = true;
-				break;
+				slot.setTo(cv::Scalar::all(0));
+			}
+			else if (!fit)
+			{
+				cv::resize(view, slot, slot.size(), 0., 0., cv::INTER_LINEAR);
+			}
+			else
+			{
+				if (view.rows != rows || view.cols != cols)
+				{
+					slot.setTo(cv::Scalar::all(0));
+				}
+				view.copyTo(slot(cv::Rect(0, 0, view.cols, view.rows)));
 			}
 		}
-		if (!flag)
-			break;
-	}
+	});
 }
 
-void ImageWidget::paintNewImageBox(QVariant box)
+quint64 ImageWidget::exportBoxMask(ImageBox* box, const QString& file)
 {
-	return paintNewImageBox(static_cast<ImageBox*>(box.value<QObject*>()));
+	if (!box)
+		return 0;
+	return d_ptr->exportMask(d, d_ptr->selectionOf(box), file);
 }
-void ImageWidget::addImageBox(QVariant box)
+
+quint64 ImageWidget::exportBoxMask(const int& id, const QString& file)
 {
-	auto val = static_cast<ImageBox*>(box.value<QObject*>());
-	addImageBox(val);
+	auto boxes = d_ptr->selectByIds({ id });
+	if (boxes.empty())
+		return 0;
+	return d_ptr->exportMask(d, boxes.front(), file);
 }
 
-ImageBox* ImageWidget::getImageBoxFromId(const int& id)
+void ImageWidget::setLiveRoiStatisticsEnabled(const bool& enable)
 {
-	ImageBox* found_ptr(nullptr);
-	for (auto& a : d_ptr->box_list)
-	{
-		if (a->getBoxID() == -1)
-			continue;
-		if (a->getBoxID() == id)
-		{
-			found_ptr = a;
-			break;
-		}
-	}
-	return found_ptr;
+	d_ptr->live_statistics = enable;
 }
 
-QVariant ImageWidget::getImageBoxVarFromId(const int& id)
+bool ImageWidget::isLiveRoiStatisticsEnabled()
 {
-	QVariant var;
-	var.setValue( static_cast<QObject*>(getImageBoxFromId(id)));
-	return var;
+	return d_ptr->live_statistics;
 }
 
-QList<ImageBox*> ImageWidget::getImageBoxsFromName(const QString& name)
+std::vector<ImageBoxData> ImageWidget::getImageBoxData()
 {
-	QList<ImageBox*> out;
+	std::vector<ImageBoxData> out;
+	out.reserve(size_t(d_ptr->box_list.size()) + d_ptr->light_boxes.size());
 	for (auto& a : d_ptr->box_list)
 	{
-		if (a->getName() == name)
-		{
-			out.push_back(a);
-		}
+		out.push_back(a->getData());
 	}
+	out.insert(out.end(), d_ptr->light_boxes.rbegin(), d_ptr->light_boxes.rend());
 	return out;
 }
 
 QVariantList ImageWidget::getImageBoxVarlistFromName(const QString& name)
 {
 	QList<QVariant> out;
+	//从后往前提升（上层先提升），与末尾交换删除不会影响尚未处理的序号
+	bool promoted(false);
+	for (size_t i = d_ptr->light_boxes.size(); i-- > 0;)
+	{
+		if (d_ptr->light_boxes[i].name == name)
+		{
+			d_ptr->promoteLight(i, false);
+			promoted = true;
+		}
+	}
+	if (promoted)
+	{
+		update();
+	}
 	auto rtn = getImageBoxsFromName(name);
 	for (auto& node: rtn)
 	{
@@ -1203,135 +6377,484 @@ void ImageWidget::clearAllBoxs()
 {
 	for (auto& a : d_ptr->box_list)
 	{
+		QObject::disconnect(a, nullptr, d_ptr, nullptr);
 		a->deleteLater();
 	}
 	d_ptr->box_list.clear();
+	d_ptr->clearLight();
+	d_ptr->grabed_box_ptr = nullptr;
 	update();
 }
 
 void ImageBox::operator=(const ImageBox& box)
 {
 	display = box.display;
-	name = box.name;
-	boxID = box.boxID;
 	env = box.env;
 	editing = box.editing;
+	setName(box.name);
+	setBoxID(box.boxID);
+	touch();
 }
 
-ImageBox::ImageBox(const ImageBox& other)
+ImageBox::ImageBox(const ImageBox& other) :
+	boxID(-1),
+	display(true),
+	env(false),
+	editing(false),
+	revision(0)
 {
 	*this = other;
 }
 
-
-void PaintData::paintDatas(QPainter* painter, ImageWidgetBasePrivate* d_ptr)
+//PaintData按样式(颜色、线宽、填充)分组后的结构数组，图像坐标
+class PaintDataBatch
 {
-	for (const auto& line : lines)
+public:
+	struct LineGroup
+	{
+		QColor color;
+		int thickness;
+		std::vector<QLineF> lines;
+		std::vector<QRectF> bounds;
+		double min_extent = 0.;
+		PaintGridIndex index;
+	};
+	struct ShapeGroup
 	{
-		QLineF paint_line;
-		const auto& [p1, p2, thinkness, color] = line;
-		auto pen_color = QColor(color[2], color[1], color[0]);
+		QColor color;
+		int thickness;
+		bool fill;
+		std::vector<QRectF> rects;
+		std::vector<QRectF> bounds;
+		double min_extent = 0.;
+		PaintGridIndex index;
+	};
+	struct TextGroup
+	{
+		QColor color;
+		int font_id;
+		int pixel_size;
+		std::vector<QPointF> positions;
+		std::vector<QString> texts;
+		std::vector<QRectF> bounds;
+		PaintGridIndex index;
+	};
+	std::vector<LineGroup> line_groups;
+	std::vector<ShapeGroup> rect_groups;
+	std::vector<ShapeGroup> circle_groups;
+	std::vector<LineGroup> corss_line_groups;
+	std::vector<TextGroup> text_groups;
+	std::array<size_t, 5> counts;
+	std::array<const void*, 5> sources;
+
+	static std::array<size_t, 5> countOf(const PaintData& data)
+	{
+		return { data.lines.size(), data.rects.size(), data.circles.size(), data.corss_lines.size(), data.texts.size() };
+	}
 
-		paint_line.setP1(d_ptr->getPaintPosition<QPoint>(QPoint(p1.x, p1.y)));
-		paint_line.setP2(d_ptr->getPaintPosition<QPoint>(QPoint(p2.x, p2.y)));
+	static std::array<const void*, 5> sourcesOf(const PaintData& data)
+	{
+		return { data.lines.data(), data.rects.data(), data.circles.data(), data.corss_lines.data(), data.texts.data() };
+	}
 
-		QPen pen(pen_color);
-		pen.setWidth(thinkness);
-		painter->setPen(pen);
-		painter->drawLine(paint_line);
+	//元素数或存储地址变化时缓存失效，原地改写由PaintData::invalidate处理
+	bool matches(const PaintData& data) const
+	{
+		return counts == countOf(data) && sources == sourcesOf(data);
 	}
-	for (const auto& rect : rects)
+
+	static QColor toQColor(const cv::Scalar& color)
 	{
-		QRectF paint_rect;
-		const auto& [cvr, thinkness, color] = rect;
-		auto pen_color = QColor(color[2], color[1], color[0]);
-		paint_rect.setTopLeft(d_ptr->getPaintPosition<QPoint>(QPoint(cvr.x, cvr.y)));
-		paint_rect.setBottomRight(d_ptr->getPaintPosition<QPoint>(QPoint(cvr.br().x, cvr.br().y)));
-		QPen pen(pen_color);
-		QBrush brush(pen_color);
-		brush.setStyle(thinkness < 0 ? Qt::SolidPattern : Qt::NoBrush);
-		if (thinkness > 0)
-			pen.setWidth(thinkness);
-		painter->setPen(pen);
-		painter->setBrush(brush);
-		painter->drawRect(paint_rect);
+		return QColor(int(color[2]), int(color[1]), int(color[0]));
 	}
-	for (const auto& rect : circles)
+
+	template <typename G>
+	static G& groupOf(std::vector<G>& groups, std::map<std::tuple<QRgb, int, int>, size_t>& index, const cv::Scalar& color, const int& a, const int& b)
 	{
-		QRectF paint_rect;
-		const auto& [cvr, thinkness, color] = rect;
-		auto pen_color = QColor(color[2], color[1], color[0]);
-		paint_rect.setTopLeft(d_ptr->getPaintPosition<QPoint>(QPoint(cvr.x, cvr.y)));
-		paint_rect.setBottomRight(d_ptr->getPaintPosition<QPoint>(QPoint(cvr.br().x, cvr.br().y)));
-		QPen pen(pen_color);
-		pen.setStyle(Qt::PenStyle::SolidLine);
-		QBrush brush(pen_color);
-		brush.setStyle(thinkness < 0 ? Qt::SolidPattern : Qt::NoBrush);
-		if (brush.style() == Qt::NoBrush)
-			pen.setWidth(thinkness);
+		auto qcolor = toQColor(color);
+		auto key = std::make_tuple(qcolor.rgb(), a, b);
+		auto iter = index.find(key);
+		if (iter != index.end())
+		{
+			return groups[iter->second];
+		}
+		index.emplace(key, groups.size());
+		groups.emplace_back();
+		groups.back().color = qcolor;
+		return groups.back();
+	}
 
-		painter->setPen(pen);
-		painter->setBrush(brush);
-		painter->drawEllipse(paint_rect);
+	static double minExtent(const std::vector<QRectF>& bounds)
+	{
+		double extent(std::numeric_limits<double>::max());
+		for (const auto& b : bounds)
+		{
+			extent = std::min(extent, std::max(b.width(), b.height()));
+		}
+		return extent;
 	}
-	for (const auto& center : corss_lines)
+
+	static void buildIndex(LineGroup& group)
 	{
-		const auto& [center_pos, wh,thinkness,color] = center;
-		QLineF line1(d_ptr->getPaintPosition<QPointF>(QPointF(center_pos.x - wh / 2., center_pos.y)), d_ptr->getPaintPosition<QPointF>(QPointF(center_pos.x + wh / 2., center_pos.y)));
-		QLineF line2(d_ptr->getPaintPosition<QPointF>(QPointF(center_pos.x,center_pos.y - wh / 2.)), d_ptr->getPaintPosition<QPointF>(QPointF(center_pos.x, center_pos.y + wh / 2.)));
-		auto pen_color = QColor(color[2], color[1], color[0]);
-		QPen pen(pen_color);
-		pen.setStyle(Qt::PenStyle::SolidLine);
-		QBrush brush(pen_color);
-		brush.setStyle(thinkness < 0 ? Qt::SolidPattern : Qt::NoBrush);
-		if (brush.style() == Qt::NoBrush)
-			pen.setWidth(thinkness);
-		painter->setPen(pen);
-		painter->setBrush(brush);
-		painter->drawLine(line1);
-		painter->drawLine(line2);
+		group.bounds.reserve(group.lines.size());
+		for (const auto& line : group.lines)
+		{
+			group.bounds.push_back(QRectF(line.p1(), line.p2()).normalized());
+		}
+		group.min_extent = minExtent(group.bounds);
+		group.index.build(group.bounds);
 	}
-	for (const auto& text_tuple : texts)
+
+	static void buildIndex(ShapeGroup& group)
 	{
-		const auto& [text, pos, pixel_size, font_style, color] = text_tuple;
+		group.bounds.reserve(group.rects.size());
+		for (const auto& rect : group.rects)
+		{
+			group.bounds.push_back(rect.normalized());
+		}
+		group.min_extent = minExtent(group.bounds);
+		group.index.build(group.bounds);
+	}
 
-		auto pen_color = QColor(color[2], color[1], color[0]);
-		QPen pen(pen_color);
-		QFont font;
-		font.setFamily(font_style.c_str());
-		auto text_scale = pixel_size * d_ptr->getPower();
-		font.setPixelSize(std::floor(text_scale < 1 ? 1 : text_scale));
-		painter->setPen(pen);
-		painter->setFont(font);
-		painter->drawText(d_ptr->getPaintPosition<QPointF>(QPoint(pos.x,pos.y)),text.c_str());
+	static void buildIndex(TextGroup& group)
+	{
+		group.bounds.reserve(group.positions.size());
+		for (size_t i = 0; i < group.positions.size(); i++)
+		{
+			//文字高度与pixel_size同为图像像素，宽度按字符数估计
+			auto h = double(std::max(1, group.pixel_size));
+			group.bounds.push_back(QRectF(group.positions[i].x(), group.positions[i].y() - h, h * std::max(1, group.texts[i].size()), h * 1.5));
+		}
+		group.index.build(group.bounds);
 	}
-}
 
-PaintData& PaintData::operator<<(PaintData& inp)
-{
-	for (auto& a : inp.lines)
+	PaintDataBatch(const PaintData& data) :
+		counts(countOf(data)),
+		sources(sourcesOf(data))
+	{
+		std::map<std::tuple<QRgb, int, int>, size_t> index;
+		for (const auto& line : data.lines)
+		{
+			const auto& [p1, p2, thinkness, color] = line;
+			auto& group = groupOf(line_groups, index, color, thinkness, 0);
+			group.thickness = thinkness;
+			group.lines.emplace_back(QPointF(p1.x, p1.y), QPointF(p2.x, p2.y));
+		}
+		index.clear();
+		for (const auto& rect : data.rects)
+		{
+			const auto& [cvr, thinkness, color] = rect;
+			auto& group = groupOf(rect_groups, index, color, thinkness, thinkness < 0);
+			group.thickness = thinkness;
+			group.fill = thinkness < 0;
+			group.rects.emplace_back(cvr.x, cvr.y, cvr.width, cvr.height);
+		}
+		index.clear();
+		for (const auto& circle : data.circles)
+		{
+			const auto& [cvr, thinkness, color] = circle;
+			auto& group = groupOf(circle_groups, index, color, thinkness, thinkness < 0);
+			group.thickness = thinkness;
+			group.fill = thinkness < 0;
+			group.rects.emplace_back(cvr.x, cvr.y, cvr.width, cvr.height);
+		}
+		index.clear();
+		for (const auto& center : data.corss_lines)
+		{
+			const auto& [center_pos, wh, thinkness, color] = center;
+			auto& group = groupOf(corss_line_groups, index, color, thinkness, 0);
+			group.thickness = thinkness;
+			group.lines.emplace_back(QPointF(center_pos.x - wh / 2., center_pos.y), QPointF(center_pos.x + wh / 2., center_pos.y));
+			group.lines.emplace_back(QPointF(center_pos.x, center_pos.y - wh / 2.), QPointF(center_pos.x, center_pos.y + wh / 2.));
+		}
+		index.clear();
+		for (const auto& text_tuple : data.texts)
+		{
+			const auto& [text, pos, pixel_size, font_style, color] = text_tuple;
+			auto font_id = FontFamilyTable::instance().intern(font_style);
+			auto& group = groupOf(text_groups, index, color, font_id, pixel_size);
+			group.font_id = font_id;
+			group.pixel_size = pixel_size;
+			group.positions.emplace_back(pos.x, pos.y);
+			group.texts.push_back(QString::fromStdString(text));
+		}
+		for (auto& group : line_groups)
+			buildIndex(group);
+		for (auto& group : rect_groups)
+			buildIndex(group);
+		for (auto& group : circle_groups)
+			buildIndex(group);
+		for (auto& group : corss_line_groups)
+			buildIndex(group);
+		for (auto& group : text_groups)
+			buildIndex(group);
+	}
+
+	static QPen linePen(const QColor& color, const int& thickness)
+	{
+		QPen pen(color);
+		pen.setStyle(Qt::PenStyle::SolidLine);
+		if (thickness > 0)
+			pen.setWidth(thickness);
+		pen.setCosmetic(true);
+		return pen;
+	}
+
+	//视口分辨率的占位栅格，小于一个阈值像素的元素只在中心点着色；
+	//首次着色时才分配和清空，析构时把缓冲留给同线程的下一个栅格，局部重绘的临时批次不再每次分配整幅图像
+	struct LodRaster
+	{
+		QImage image;
+		QSize size;
+		uchar* bits = nullptr;
+		int bytes_per_line = 0;
+		double power = 1.;
+		QPointF origin;
+		bool used = false;
+
+		~LodRaster()
+		{
+			auto& spare = spareImage();
+			if (!image.isNull() && spare.isNull())
+			{
+				spare.swap(image);
+			}
+		}
+
+		static QImage& spareImage()
+		{
+			static thread_local QImage spare;
+			return spare;
+		}
+
+		void reset(const QSize& s, const double& p, const QPointF& o)
+		{
+			size = s;
+			power = p;
+			origin = o;
+			bits = nullptr;
+			used = false;
+		}
+
+		void plot(const QRectF& b, const QRgb& color)
+		{
+			auto x = int((b.center().x() - origin.x()) * power);
+			auto y = int((b.center().y() - origin.y()) * power);
+			if (x < 0 || y < 0 || x >= size.width() || y >= size.height())
+				return;
+			if (!used)
+			{
+				begin();
+			}
+			reinterpret_cast<QRgb*>(bits + size_t(y) * bytes_per_line)[x] = color;
+		}
+
+	private:
+		void begin()
+		{
+			if (image.size() != size)
+			{
+				auto& spare = spareImage();
+				if (spare.size() == size)
+					image.swap(spare);
+				else
+					image = QImage(size, QImage::Format_ARGB32_Premultiplied);
+			}
+			image.fill(Qt::transparent);
+			bits = image.bits();
+			bytes_per_line = image.bytesPerLine();
+			used = true;
+		}
+	};
+
+	//返回需要精确绘制的元素，未建索引或全部可见时直接返回原数组；
+	//外接矩形小于lod_extent（图像坐标）的元素画到raster中
+	template <typename T>
+	const std::vector<T>& visibleItems(const std::vector<T>& all, const std::vector<QRectF>& bounds, const PaintGridIndex& index, const QRectF& window, const double& min_extent, const double& lod_extent, const QColor& color) const
 	{
-		lines.push_back(std::move(a));
+		bool use_lod = lod_extent > 0. && min_extent < lod_extent;
+		bool use_all = !index.isBuilt() || index.coversAll(window);
+		if (use_all && !use_lod)
+		{
+			return all;
+		}
+		if (!use_all)
+		{
+			index.query(window, bounds, visible_index);
+		}
+		auto& out = scratchOf(static_cast<const T*>(nullptr));
+		out.clear();
+		auto rgb = qPremultiply(color.rgba());
+		auto visit = [&](const size_t& i) {
+			const auto& b = bounds[i];
+			if (use_lod && std::max(b.width(), b.height()) < lod_extent)
+			{
+				lod_raster.plot(b, rgb);
+			}
+			else
+			{
+				out.push_back(all[i]);
+			}
+		};
+		if (use_all)
+		{
+			for (size_t i = 0; i < all.size(); i++)
+			{
+				visit(i);
+			}
+		}
+		else
+		{
+			for (const auto& i : visible_index)
+			{
+				visit(size_t(i));
+			}
+		}
+		return out;
 	}
-	for (auto& a : inp.circles)
+
+	std::vector<QLineF>& scratchOf(const QLineF*) const
 	{
-		circles.push_back(std::move(a));
-	}	
-	for (auto& a : inp.rects)
+		return line_scratch;
+	}
+
+	std::vector<QRectF>& scratchOf(const QRectF*) const
 	{
-		rects.push_back(std::move(a));
-	}	
-	for (auto& a : inp.texts)
+		return rect_scratch;
+	}
+
+	void paint(QPainter* painter, ImageWidgetBasePrivate* d_ptr) const
 	{
-		texts.push_back(std::move(a));
+		auto power = d_ptr->getPower();
+		auto window = d_ptr->getVisibleImageRect();
+		//线宽按屏幕像素计算，换算成图像坐标作为外扩
+		auto margin_of = [power](const int& thickness) { return (std::max(thickness, 1) + 2) / std::max(power, 1e-9); };
+		auto lod_pixels = d_ptr->getOverlayLodThreshold();
+		auto lod_extent = lod_pixels > 0. ? lod_pixels / std::max(power, 1e-9) : 0.;
+		if (lod_extent > 0.)
+		{
+			lod_raster.reset(d_ptr->getWidgetSize(), power, window.topLeft());
+		}
+		painter->save();
+		painter->setTransform(d_ptr->getPaintTransform(), true);
+		painter->setBrush(Qt::NoBrush);
+		for (const auto& group : line_groups)
+		{
+			auto m = margin_of(group.thickness);
+			const auto& lines = visibleItems(group.lines, group.bounds, group.index, window.adjusted(-m, -m, m, m), group.min_extent, lod_extent, group.color);
+			painter->setPen(linePen(group.color, group.thickness));
+			painter->drawLines(lines.data(), int(lines.size()));
+		}
+		for (const auto& group : rect_groups)
+		{
+			auto m = margin_of(group.thickness);
+			const auto& rects = visibleItems(group.rects, group.bounds, group.index, window.adjusted(-m, -m, m, m), group.min_extent, lod_extent, group.color);
+			painter->setPen(linePen(group.color, group.thickness));
+			painter->setBrush(group.fill ? QBrush(group.color) : QBrush(Qt::NoBrush));
+			painter->drawRects(rects.data(), int(rects.size()));
+		}
+		for (const auto& group : circle_groups)
+		{
+			auto m = margin_of(group.thickness);
+			const auto& rects = visibleItems(group.rects, group.bounds, group.index, window.adjusted(-m, -m, m, m), group.min_extent, lod_extent, group.color);
+			painter->setPen(linePen(group.color, group.thickness));
+			painter->setBrush(group.fill ? QBrush(group.color) : QBrush(Qt::NoBrush));
+			for (const auto& rect : rects)
+			{
+				painter->drawEllipse(rect);
+			}
+		}
+		painter->setBrush(Qt::NoBrush);
+		for (const auto& group : corss_line_groups)
+		{
+			auto m = margin_of(group.thickness);
+			const auto& lines = visibleItems(group.lines, group.bounds, group.index, window.adjusted(-m, -m, m, m), group.min_extent, lod_extent, group.color);
+			painter->setPen(linePen(group.color, group.thickness));
+			painter->drawLines(lines.data(), int(lines.size()));
+		}
+		painter->restore();
+		if (lod_extent > 0. && lod_raster.used)
+		{
+			painter->drawImage(QPointF(0, 0), lod_raster.image);
+		}
+		//文字大小随缩放变化，不使用变换绘制
+		for (const auto& group : text_groups)
+		{
+			auto text_scale = group.pixel_size * power;
+			auto pixel_size = int(std::floor(text_scale < 1 ? 1 : text_scale));
+			painter->setPen(QPen(group.color));
+			bool use_all = !group.index.isBuilt() || group.index.coversAll(window);
+			if (!use_all)
+			{
+				group.index.query(window, group.bounds, visible_index);
+			}
+			auto count = use_all ? group.texts.size() : visible_index.size();
+			//可见文字多于缓存容量时每帧都会被挤出，直接绘制
+			bool direct = count > size_t(d_ptr->getTextCacheCapacity());
+			if (direct)
+			{
+				QFont font;
+				font.setFamily(FontFamilyTable::instance().name(group.font_id));
+				font.setPixelSize(pixel_size);
+				painter->setFont(font);
+			}
+			for (size_t k = 0; k < count; k++)
+			{
+				auto i = use_all ? k : size_t(visible_index[k]);
+				auto pos = d_ptr->getPaintPosition<QPointF>(group.positions[i]);
+				if (direct)
+				{
+					painter->drawText(pos, group.texts[i]);
+				}
+				else
+				{
+					d_ptr->drawCachedText(painter, pos, group.texts[i], group.font_id, pixel_size);
+				}
+			}
+		}
 	}
-	for (auto& a : inp.corss_lines)
+private:
+	mutable std::vector<int> visible_index;
+	mutable std::vector<QLineF> line_scratch;
+	mutable std::vector<QRectF> rect_scratch;
+	mutable LodRaster lod_raster;
+};
+
+void PaintData::paintDatas(QPainter* painter, ImageWidgetBasePrivate* d_ptr) const
+{
+	if (!cache.batch || !cache.batch->matches(*this))
 	{
-		corss_lines.push_back(std::move(a));
+		cache.batch = std::make_shared<PaintDataBatch>(*this);
 	}
+	cache.batch->paint(painter, d_ptr);
+}
+
+PaintData& PaintData::operator<<(PaintData& inp)
+{
+	//按倍数预留，反复合并时保持几何增长
+	auto append = [](auto& dst, auto& src) {
+		auto needed = dst.size() + src.size();
+		if (needed > dst.capacity())
+		{
+			dst.reserve(std::max(needed, dst.capacity() * 2));
+		}
+		dst.insert(dst.end(), std::make_move_iterator(src.begin()), std::make_move_iterator(src.end()));
+	};
+	append(lines, inp.lines);
+	append(circles, inp.circles);
+	append(rects, inp.rects);
+	append(texts, inp.texts);
+	append(corss_lines, inp.corss_lines);
+	invalidate();
+	inp.invalidate();
 	return *this;
 }
 
+void PaintData::invalidate()
+{
+	cache.batch.reset();
+}
+
 void PaintData::drawDatas(cv::Mat& mat) const
 {
 	for (const auto& line : lines)
@@ -1378,9 +6901,10 @@ ImageBox::ImageBox(
 	name(name),
 	display(display),
 	editing(false),
-	env(env)
+	env(env),
+	revision(0)
 {
-
+	touch();
 }
 
 RectImageBox::RectImageBox(QObject* parent):
@@ -1444,11 +6968,13 @@ bool ImageBox::isEnv()
 void ImageBox::setIsEnv(const bool& e)
 {
 	env = e;
+	touch();
 }
 
 void ImageBox::setIsDisplay(const bool& d)
 {
 	display = d;
+	touch();
 }
 
 int ImageBox::getBoxID()
@@ -1458,7 +6984,11 @@ int ImageBox::getBoxID()
 
 void ImageBox::setBoxID(const int& i)
 {
+	if (boxID == i)
+		return;
 	boxID = i;
+	touch();
+	emit boxIDChanged();
 }
 
 QString ImageBox::getName()
@@ -1468,7 +6998,11 @@ QString ImageBox::getName()
 
 void ImageBox::setName(const QString& n)
 {
+	if (name == n)
+		return;
 	name = n;
+	touch();
+	emit nameChanged();
 }
 
 bool ImageBox::getEditing()
@@ -1478,7 +7012,27 @@ bool ImageBox::getEditing()
 
 void ImageBox::setEditing(const bool& e)
 {
+	if (editing == e)
+		return;
 	editing = e;
+	touch();
+}
+
+void ImageBox::touch()
+{
+	//全局递增，不同框的版本号也互不相同
+	static std::atomic<quint64> revision_counter(0);
+	revision = ++revision_counter;
+}
+
+ImageBoxData ImageBox::getData()
+{
+	ImageBoxData data;
+	data.id = boxID;
+	data.name = name;
+	data.display = display;
+	data.env = env;
+	return data;
 }
 
 QVariant ImageBox::getMaskVar(const int& width, const int&height)
@@ -1488,6 +7042,46 @@ QVariant ImageBox::getMaskVar(const int& width, const int&height)
 	return var;
 }
 
+BoxMask ImageBox::getCroppedMask(const QSize& sz)
+{
+	BoxMask out;
+	out.outside = env ? 255 : 0;
+	auto full = getMask(sz);
+	if (full.empty())
+		return out;
+	auto bounds = cv::boundingRect(full != out.outside);
+	if (bounds.empty())
+		return out;
+	out.offset = bounds.tl();
+	out.mask = full(bounds).clone();
+	return out;
+}
+
+std::vector<MaskSpan> ImageBox::getMaskSpans(const QSize& sz)
+{
+	std::vector<MaskSpan> out;
+	auto full = getMask(sz);
+	for (int y = 0; y < full.rows; y++)
+	{
+		auto row = full.ptr<uchar>(y);
+		for (int x = 0; x < full.cols;)
+		{
+			if (!row[x])
+			{
+				x++;
+				continue;
+			}
+			auto x0 = x;
+			while (x < full.cols && row[x])
+			{
+				x++;
+			}
+			out.push_back({ y, x0, x });
+		}
+	}
+	return out;
+}
+
 RectImageBox::RectImageBox(const RectImageBox& other) :
 	ImageBox(other)
 {
@@ -1512,10 +7106,12 @@ void RectImageBox::operator=(const RectImageBox& rb)
 	height = rb.height;
 
 	display = rb.display;
-	name = rb.name;
-	boxID = rb.boxID;
 	env = rb.env;
 	editing = rb.editing;
+	setName(rb.name);
+	setBoxID(rb.boxID);
+	touch();
+	emit geometryChanged();
 }
 
 RectImageBox::~RectImageBox()
@@ -1533,6 +7129,24 @@ void RectImageBox::fromQRect(const QRect& rect)
 	y = rect.y();
 	width = rect.width();
 	height = rect.height();
+	touch();
+	emit geometryChanged();
+}
+
+ImageBoxData RectImageBox::getData()
+{
+	auto data = ImageBox::getData();
+	data.x = x;
+	data.y = y;
+	data.width = width;
+	data.height = height;
+	data.color = pen.color();
+	return data;
+}
+
+QRectF RectImageBox::getBoundingRect()
+{
+	return QRectF(x, y, width, height).normalized();
 }
 
 QRectF RectImageBox::getQRectF()
@@ -1546,6 +7160,8 @@ void RectImageBox::fromQRectF(const QRectF& rect)
 	y = rect.y();
 	width = rect.width();
 	height = rect.height();
+	touch();
+	emit geometryChanged();
 }
 
 cv::Rect RectImageBox::getCVRect()
@@ -1559,6 +7175,8 @@ Q_INVOKABLE void RectImageBox::fromCVRect(const cv::Rect& rect)
 	y = rect.y;
 	width = rect.width;
 	height = rect.height;
+	touch();
+	emit geometryChanged();
 }
 
 void RectImageBox::paintShape(QPainter* painter, ImageWidgetBasePrivate* d)
@@ -1576,13 +7194,21 @@ void RectImageBox::paintShape(QPainter* painter, ImageWidgetBasePrivate* d)
 		painter->setBrush(brush);
 	}
 	painter->drawRect(d->getPaintRect<QRectF>(QRectF(x,y,width,height)));
-	QFont font;
-	font.setFamily("Microsoft YaHei");
-	double text_scale = 16 /** d->getPower()*/;
-	font.setPixelSize(std::floor(text_scale < 1 ? 1 : text_scale));
+	paintLabel(painter, d);
+}
+
+void RectImageBox::paintLabel(QPainter* painter, ImageWidgetBasePrivate* d)
+{
+	static const int label_font = FontFamilyTable::instance().intern("Microsoft YaHei");
+	QRect geometry(int(x), int(y), int(width), int(height));
+	if (label.isEmpty() || geometry != label_geometry || name != label_name)
+	{
+		label = "Name:" + name + QString(" (%1,%2,%3,%4)").arg(QString::number(geometry.x()), QString::number(geometry.y()), QString::number(geometry.width()), QString::number(geometry.height()));
+		label_name = name;
+		label_geometry = geometry;
+	}
 	painter->setPen(QPen(pen.color()));
-	painter->setFont(font);
-	painter->drawText(d->getPaintPosition<QPointF>(QPoint(x, y)), "Name:" + getName() + QString(" (%1,%2,%3,%4)").arg(QString::number(int(x)), QString::number(int(y)), QString::number(int(width)), QString::number(int(height))));
+	d->drawCachedText(painter, d->getPaintPosition<QPointF>(QPoint(x, y)), label, label_font, 16);
 }
 
 bool RectImageBox::isInBox(const QPoint& p)
@@ -1598,6 +7224,8 @@ void RectImageBox::moveBox(const QPointF& vec,const QSize& is)
 		x += vec.x();
 	if(y + vec.y() >= 0 && (y + vec.y() + height) < is.height())
 		y += vec.y();
+	touch();
+	emit geometryChanged();
 }
 
 std::optional<ImageBox::GrabedEdgeType> RectImageBox::checkPress(const QPoint& p, const double& power)
@@ -1772,26 +7400,48 @@ cv::Mat RectImageBox::getMask(const QSize& sz)
 	return out;
 }
 
+BoxMask RectImageBox::getCroppedMask(const QSize& sz)
+{
+	std::vector<MaskSpan> spans;
+	appendShapeSpans(getData(), cv::Size(sz.width(), sz.height()), spans);
+	return spansToCroppedMask(spans, env);
+}
+
+std::vector<MaskSpan> RectImageBox::getMaskSpans(const QSize& sz)
+{
+	std::vector<MaskSpan> spans;
+	appendShapeSpans(getData(), cv::Size(sz.width(), sz.height()), spans);
+	return env ? invertSpans(spans, cv::Size(sz.width(), sz.height())) : spans;
+}
+
 
 void RectImageBox::normalize()
 {
 	auto nor = QRectF(x, y, width, height).normalized();
+	if (nor == QRectF(x, y, width, height))
+		return;
 	x = nor.x();
 	y = nor.y();
 	width = nor.width();
 	height = nor.height();
+	touch();
+	emit geometryChanged();
 }
 
 void RectImageBox::startPaint(const QPointF& pnt)
 {
 	x = pnt.x();
 	y = pnt.y();
+	touch();
+	emit geometryChanged();
 }
 
 void RectImageBox::endPaint(const QPointF& pnt)
 {
 	width = pnt.x() - x;
 	height = pnt.y() - y;
+	touch();
+	emit geometryChanged();
 }
 
 void RectImageBox::editEdge(const ImageBox::GrabedEdgeType& type, const QPointF& pos)
@@ -1863,6 +7513,8 @@ void RectImageBox::fixShape(const QSize& size)
 	{
 		height = -y;
 	}
+	touch();
+	emit geometryChanged();
 }
 
 void RectImageBox::resetData()
@@ -1871,6 +7523,8 @@ void RectImageBox::resetData()
 	y = 0;
 	width = 0;
 	height = 0;
+	touch();
+	emit geometryChanged();
 }
 
 QPen RectImageBox::getPen()
@@ -1896,26 +7550,32 @@ QBrush RectImageBox::getEditingBrush()
 void RectImageBox::setPen(const QPen& p)
 {
 	pen = p;
+	touch();
 }
 
 void RectImageBox::setEditingPen(const QPen& p)
 {
 	editingPen = p;
+	touch();
 }
 
 void RectImageBox::setBrush(const QBrush& b)
 {
 	brush = b;
+	touch();
 }
 
 void RectImageBox::setEditingBrush(const QBrush& b)
 {
 	editingBrush = b;
+	touch();
 }
 
 void RectImageBox::setX(const double& x)
 {
 	this->x = x;
+	touch();
+	emit geometryChanged();
 }
 
 double RectImageBox::getX()
@@ -1926,6 +7586,8 @@ double RectImageBox::getX()
 void RectImageBox::setY(const double& y)
 {
 	this->y = y;
+	touch();
+	emit geometryChanged();
 }
 
 double RectImageBox::getY()
@@ -1936,6 +7598,8 @@ double RectImageBox::getY()
 void RectImageBox::setWidth(const double& w)
 {
 	this->width = w;
+	touch();
+	emit geometryChanged();
 }
 
 double RectImageBox::getWidth()
@@ -1946,6 +7610,8 @@ double RectImageBox::getWidth()
 void RectImageBox::setHeight(const double& h)
 {
 	this->height = h;
+	touch();
+	emit geometryChanged();
 }
 
 double RectImageBox::getHeight()
@@ -1985,6 +7651,13 @@ void EllipseImageBox::operator=(const EllipseImageBox& rb)
 	RectImageBox::operator=(rb);
 }
 
+ImageBoxData EllipseImageBox::getData()
+{
+	auto data = RectImageBox::getData();
+	data.shape = ImageBoxData::Ellipse;
+	return data;
+}
+
 cv::Mat EllipseImageBox::getMask(const QSize& sz)
 {
 	cv::Mat out(sz.height(), sz.width(), CV_8UC1, cv::Scalar(env ? 255 : 0));
@@ -2014,13 +7687,7 @@ void EllipseImageBox::paintShape(QPainter* painter, ImageWidgetBasePrivate* d)
 	auto rect_tmp = d->getPaintRect<QRectF>(QRectF(x, y, width, height));
 	painter->drawRect(rect_tmp);
 	painter->drawEllipse(rect_tmp);
-	QFont font;
-	font.setFamily("Microsoft YaHei");
-	double text_scale = 16 /** d->getPower()*/;
-	font.setPixelSize(std::floor(text_scale < 1 ? 1 : text_scale));
-	painter->setPen(QPen(pen.color()));
-	painter->setFont(font);
-	painter->drawText(d->getPaintPosition<QPointF>(QPoint(x, y)), "Name:" + getName() + QString(" (%1,%2,%3,%4)").arg(QString::number(int(x)), QString::number(int(y)), QString::number(int(width)), QString::number(int(height))));
+	paintLabel(painter, d);
 }
 #ifdef IMAGEWIDGET_QML
 #include <QQmlExtensionPlugin>